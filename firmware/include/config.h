@@ -17,31 +17,86 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <fpga.h>
 #include <statuscode.h>
 
-#define CONFIG_MAGIC 0x01584E54
+#define CONFIG_MAGIC 0x02584E54
+#define CONFIG_MAGIC_V1 0x01584E54
+#define CONFIG_MAX_TIMINGS 32
+#define CONFIG_DEFAULT_TIMEOUT 50
+
+// The config is kept in a journal of records spread over the last flash pages,
+// used as a ring. The last one is where older firmware kept the plain table.
+#define CONFIG_JOURNAL_START 0x801F000
+#define CONFIG_JOURNAL_PAGES 4
+#define CONFIG_PAGE_SIZE 0x400
+#define CONFIG_LEGACY_ADDRESS 0x801FC00
+
+// Decayed counters are halved once attempts reach this, so old history fades out
+#define CONFIG_DECAY_ATTEMPTS 64
 
 typedef struct
 {
 	uint16_t offset;
 	uint8_t width;
-	uint32_t success;
+	uint8_t fail_streak;         // consecutive sessions in which this timing was tried without success
+	uint32_t success;            // lifetime successes
+	uint16_t attempts;           // attempts made with this timing (decayed)
+	uint16_t failures;           // failed attempts among them (decayed)
+	uint16_t last_success_boot;  // config_t.boot_count of the last success
+	uint8_t subcycle_delay;      // subcycle_delay with the most successes
+	uint8_t timeout;             // timeout of the last success
+	uint8_t subcycle_hits[4];    // successes per subcycle_delay
 } timing_t;
 
 typedef struct
 {
 	uint32_t magic;
 	uint32_t count;
-	timing_t timings[32];
+	timing_t timings[CONFIG_MAX_TIMINGS];
 	uint8_t reflash;
+	uint16_t boot_count;         // glitch sessions run, successful or not
+	uint8_t spi_divider;         // FPGA SPI clock divider found by fpga_link_train(), 0 if untrained
 } config_t;
 
+// Original table layout. Still used on flash before migration and on the SDIO train data commands.
+typedef struct
+{
+	uint16_t offset;
+	uint8_t width;
+	uint32_t success;
+} timing_v1_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t count;
+	timing_v1_t timings[32];
+	uint8_t reflash;
+} config_v1_t;
+
 void config_clear(config_t *cfg);
+// Latest config, including a pending update; kept in RAM, so this is cheap
+const config_t *config_get();
 enum STATUSCODE config_load(config_t *cfg);
 enum STATUSCODE config_add_new(config_t *cfg, glitch_cfg_t *new_cfg);
 enum STATUSCODE config_save(config_t *cfg);
+// Deferred config_save(): cfg is visible through config_get() right away and written to flash
+// by the next config_commit(). At most one update is kept pending, an older one is committed
+// first, so a power cut loses at most the latest.
+enum STATUSCODE config_stage(config_t *cfg);
+enum STATUSCODE config_commit();
+bool config_pending();
 enum STATUSCODE config_reset();
 
+// Success chance per attempt of a stored timing in Q16, estimated from its decayed counters
+uint32_t config_timing_score(const timing_t *timing);
+// Account attempts made with a stored timing during this session
+void config_timing_add_attempts(timing_t *timing, unsigned int attempts, unsigned int failures);
+
+void config_to_v1(const config_t *cfg, config_v1_t *out);
+void config_from_v1(config_t *cfg, const config_v1_t *in);
+
 #endif
\ No newline at end of file
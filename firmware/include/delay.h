@@ -18,6 +18,17 @@
 #define DELAY_H
 
 #include "gd32f3x0.h"
+#include <stdbool.h>
+
+// Sleep the core with WFI through delays of at least DELAY_SLEEP_MIN_US, woken by a one-shot
+// TIMER2 alarm DELAY_SLEEP_MARGIN_US before the end; that rest and shorter delays are spun.
+#ifndef DELAY_SLEEP
+#define DELAY_SLEEP 1
+#endif
+#define DELAY_SLEEP_MIN_US 200
+#define DELAY_SLEEP_MARGIN_US 50
+// delay_until_pin() sleeps this long between looks at the pin, as long as the timeout allows
+#define DELAY_PIN_POLL_US 100
 
 /* initialization time delay function */
 void delay_init();
@@ -25,5 +36,9 @@ void delay_init();
 void delay_ms(uint32_t nms);
 /* delay us function */
 void delay_us(uint32_t nus);
+/* interrupt once after us, at most 65535, to end a WFI; arm it with interrupts masked */
+void delay_alarm(uint32_t us);
+/* wait up to timeout_us for a GPIO input to read level, false if it doesn't */
+bool delay_until_pin(uint32_t port, uint32_t pin, int level, uint32_t timeout_us, uint32_t *waited_us);
 
 #endif /* DELAY_H */
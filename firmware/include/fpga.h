@@ -19,13 +19,79 @@
 
 #include <stdint.h>
 
+// Skip writes of configuration registers whose value the FPGA already holds
+#ifndef FPGA_REG_SHADOW
+#define FPGA_REG_SHADOW 1
+#endif
+
+// Send consecutive register writes of fpga_glitch_device() in a single chip-select frame.
+// Off by default: relies on the FPGA accepting several commands per frame.
+#ifndef FPGA_SPI_BURST
+#define FPGA_SPI_BURST 0
+#endif
+
+// Move buffer reads/writes of at least FPGA_SPI_DMA_MIN_LEN bytes with DMA (SPI0 RX on
+// channel 1, TX on channel 2); register accesses stay polled.
+#ifndef FPGA_SPI_DMA
+#define FPGA_SPI_DMA 1
+#endif
+#define FPGA_SPI_DMA_MIN_LEN 16
+
+// Sleep on an EXTI interrupt from FPGA_STATUS_PIN while waiting for an FPGA event instead
+// of reading the flags back to back. The line is only trusted after it has announced
+// FPGA_EVENT_VOTES events in a row; until then, and from the first event it misses,
+// waits poll over SPI as before.
+#ifndef FPGA_EVENT_IRQ
+#define FPGA_EVENT_IRQ 1
+#endif
+#define FPGA_EVENT_VOTES 2
+#define FPGA_EVENT_SLEEP_MAX_US 1000 // longest sleep between reads, for events polled back to back
+
 extern int fpga_sync_failed;
 extern int payload_not_yet_flashed;
+extern uint32_t fpga_spi_transactions; // chip-select frames since power-on
+extern int fpga_spi_dma_enabled; // polled buffer transfers when 0
+
+// Registers behind the 0x24 (write) and 0x26 (read) commands
+enum FPGA_REG
+{
+	FPGA_REG_GLITCH_OFFSET = 0x1,
+	FPGA_REG_GLITCH_WIDTH = 0x2,
+	FPGA_REG_GLITCH_TIMEOUT = 0x3,
+	FPGA_REG_BUFFER_SELECT = 0x5,
+	FPGA_REG_CONTROL = 0x6, // commands, never shadowed
+	FPGA_REG_SUBCYCLE_DELAY = 0x8,
+	FPGA_REG_GLITCH_FLAGS = 0xA,
+	FPGA_REG_MMC_FLAGS = 0xB,
+};
+
+// Shadow copies of the write-only configuration registers. fpga_shadow_write() records
+// value and returns non-zero if it has to be sent; fpga_shadow_invalidate() forgets all
+// values, e.g. when the FPGA is power cycled.
+int fpga_shadow_write(uint8_t reg, uint16_t value);
+void fpga_shadow_invalidate();
 
 void fpga_init();
 uint32_t fpga_reset();
 void fpga_power_off();
 
+// SPI clock of the FPGA link, as divider of the 48 MHz APB2 clock. fpga_reset() runs the
+// link at the one set last, FPGA_LINK_DIVIDER_DEFAULT until then.
+#define FPGA_LINK_DIVIDER_FASTEST 2
+#define FPGA_LINK_DIVIDER_DEFAULT 4
+#define FPGA_LINK_DIVIDER_SLOWEST 8
+#define FPGA_LINK_TEST_SIZE 512
+#define FPGA_LINK_PATTERNS 4
+#define FPGA_LINK_CONFIRM_ROUNDS 8
+
+void fpga_link_set(uint8_t divider);
+uint8_t fpga_link_get();
+// Round trip test patterns through FPGA_BUFFER_CMD_DATA at divider, returns the number of bad bytes
+unsigned int fpga_link_test(uint8_t divider, unsigned int rounds);
+// Select the fastest clock that passes fpga_link_test() with margin, FPGA_LINK_DIVIDER_DEFAULT
+// if none does, even the slowest. Needs a powered FPGA.
+uint8_t fpga_link_train();
+
 enum FPGA_BUFFER
 {
 	FPGA_BUFFER_CMD = 0, // traffic on CMD line
@@ -55,12 +121,44 @@ uint8_t fpga_read_glitch_flags();
 #define FPGA_MMC_BUSY_UNKNOWN3          0x80
 uint8_t fpga_read_mmc_flags();
 
+enum FPGA_EVENT
+{
+	FPGA_EVENT_DATA_RCVD = 0, // FPGA_MMC_BUSY_LOADER_DATA_RCVD set
+	FPGA_EVENT_GLITCH_DONE = 1, // FPGA_MMC_GLITCH_SUCCESS or FPGA_MMC_GLITCH_TIMEOUT set
+	FPGA_EVENT_MMC_CMD_DONE = 2, // FPGA_MMC_BUSY_SENDING clear
+	FPGA_EVENT_COUNT,
+};
+
+// Wait for event, giving up after timeout_us unless that is 0. flags receives the mmc flags
+// read last. Returns the number of reads before the one that saw the event, all of them on
+// timeout; 0 means the event was already there. Timeouts are only as precise as the next
+// wake-up while sleeping.
+unsigned int fpga_wait_event(enum FPGA_EVENT event, uint32_t timeout_us, uint8_t *flags);
+
 uint32_t fpga_read_type();
 void fpga_do_mmc_command();
 
 void fpga_read_buffer(uint8_t *buffer, uint32_t size);
 void fpga_write_buffer(uint8_t *buffer, uint32_t size);
 
+// fpga_read_buffer() in pieces: the buffer is read from its start within one chip-select
+// frame, as far as fpga_read_buffer_next() gets before fpga_read_buffer_end().
+void fpga_read_buffer_begin();
+void fpga_read_buffer_next(uint8_t *buffer, uint32_t size);
+void fpga_read_buffer_end();
+
+// FPGA_BUFFER_CMD starts with a header of the eMMC traffic captured during a glitch attempt;
+// the traffic itself is in FPGA_BUFFER_RESP_DATA.
+#define FPGA_CAPTURE_LEN_OFFSET 0x10
+
+// Start a buffer transfer and return. done is called from the DMA interrupt once chip
+// select is released; any other FPGA access waits until then. Without DMA the transfer
+// completes before returning.
+typedef void (*fpga_transfer_done_t)();
+void fpga_read_buffer_async(uint8_t *buffer, uint32_t size, fpga_transfer_done_t done);
+void fpga_write_buffer_async(uint8_t *buffer, uint32_t size, fpga_transfer_done_t done);
+int fpga_transfer_busy();
+
 void fpga_enter_cmd_mode();
 void fpga_pre_recv();
 void fpga_post_recv();
@@ -22,6 +22,48 @@
 #include <statuscode.h>
 #include <session_info.h>
 
+#define MAX_GLITCH_WIDTH 85
+#define MIN_GLITCH_WIDTH 15
+#define START_GLITCH_WIDTH ((MAX_GLITCH_WIDTH + MIN_GLITCH_WIDTH) / 2)
+
+// Offset search strategy used by glitch_search_new_offset():
+// 1 = Thompson sampling over the (offset, width) grid, see glitch_bandit.h
+// 0 = walk the offset table and let the heuristic nudge the width
+#ifndef GLITCH_SEARCH_BANDIT
+#define GLITCH_SEARCH_BANDIT 1
+#endif
+
+// Score failed attempts by how far the boot ROM got after the pulse, from the captured
+// eMMC traffic, and lean the offset search towards offsets that get further.
+#ifndef GLITCH_DEPTH_SEARCH
+#define GLITCH_DEPTH_SEARCH 1
+#endif
+
+// Boot progress depth of an attempt: 0 silent bus, 1 hung after the pulse, 2 eMMC reset,
+// 2 + n after n block reads, GLITCH_DEPTH_MAX once the payload is read.
+#define GLITCH_DEPTH_MAX 15
+#define GLITCH_DEPTH_MAX_READS (GLITCH_DEPTH_MAX - 3)
+
+// Training runs glitch sessions until the first stored timing tried wins often enough to
+// trust the table: until the lower one-sided Wilson bound of the share of sessions it wins
+// reaches GLITCH_TRAIN_TARGET percent. Evidence starts over whenever another
+// timing moves to the front.
+#ifndef GLITCH_TRAIN_TARGET
+#define GLITCH_TRAIN_TARGET 80
+#endif
+#define GLITCH_TRAIN_Z100 164 // z of the bound x100, 95% confidence
+#define GLITCH_TRAIN_MIN_SUCCESSES 10
+#define GLITCH_TRAIN_MAX_SUCCESSES 150 // gives up on a table that doesn't settle
+
+typedef struct
+{
+	uint16_t successes; // successful sessions
+	uint16_t first_offset; // first timing of the next session, 0xFFFF for an empty table
+	uint8_t first_width;
+	uint16_t sessions; // since that timing is first
+	uint16_t hits; // of those, won by it
+} glitch_train_t;
+
 enum GLITCH_RESULT_TYPE
 {
 	GLITCH_RESULT_FAIL_NO_EMMC_COMMS = 0,
@@ -32,4 +74,8 @@ enum GLITCH_RESULT_TYPE
 
 enum STATUSCODE glitch(logger *lgr, session_info_t *session_info, bool is_training);
 
+void glitch_train_init(glitch_train_t *train);
+// Account a training session; true once training is done
+bool glitch_train_add(glitch_train_t *train, enum STATUSCODE status, const session_info_t *session_info);
+
 #endif
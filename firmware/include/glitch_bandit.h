@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GLITCH_BANDIT_H__
+#define __GLITCH_BANDIT_H__
+
+#include <stdint.h>
+#include <fpga.h>
+#include <glitch.h>
+
+// Thompson sampling over a grid of (offset, width) cells. Every cell keeps its
+// success/failure counts; the Beta prior of a cell is derived from how often
+// pulses of that width hung the CPU vs. had no effect, since the sweet spot
+// sits on the boundary between the two. With GLITCH_DEPTH_SEARCH the prior is further
+// tilted towards offsets whose failed attempts got the boot ROM further.
+#define BANDIT_OFFSET_BINS 17
+#define BANDIT_WIDTH_BINS ((MAX_GLITCH_WIDTH - MIN_GLITCH_WIDTH) / BANDIT_BIN_SIZE + 1)
+#define BANDIT_BIN_SIZE 5
+
+typedef struct
+{
+	uint8_t success;
+	uint8_t failure;
+} bandit_cell_t;
+
+typedef struct
+{
+	uint16_t sum; // of boot progress depths, see GLITCH_DEPTH_MAX
+	uint8_t count;
+} bandit_depth_t;
+
+// (Re)initialize for an offset window starting at first_offset, spaced BANDIT_BIN_SIZE apart.
+// Learned counts are kept across calls for the same window, i.e. across training steps.
+void bandit_init(uint16_t first_offset, uint32_t seed);
+void bandit_add_result(const glitch_cfg_t *cfg, enum GLITCH_RESULT_TYPE result, uint8_t depth);
+void bandit_next(glitch_cfg_t *cfg);
+
+#endif
@@ -21,6 +21,13 @@
 #include <stdbool.h>
 #include <glitch.h>
 
+// Heuristic used to adjust width and offset between attempts:
+// 0 = count results over fixed windows of 8 attempts, decide at 8 and 16
+// 1 = sequential probability ratio tests, decide as soon as the evidence suffices
+#ifndef GLITCH_HEURISTIC_SPRT
+#define GLITCH_HEURISTIC_SPRT 1
+#endif
+
 typedef struct
 {
 	uint8_t total_count;
@@ -28,6 +35,13 @@ typedef struct
 	uint8_t timeout_count;
 	uint8_t block_read_count;
 
+#if GLITCH_HEURISTIC_SPRT
+	// Log-likelihood ratios in Q8, see glitch_heuristic.c
+	int16_t llr_too_long;
+	int16_t llr_too_short;
+	int16_t llr_move_on;
+	int16_t llr_no_comms;
+#endif
 } glitch_heuristic_t;
 
 void heuristic_add_result(glitch_heuristic_t *heuristic, enum GLITCH_RESULT_TYPE result);
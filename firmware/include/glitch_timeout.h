@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GLITCH_TIMEOUT_H__
+#define __GLITCH_TIMEOUT_H__
+
+#include <stdint.h>
+#include <glitch.h>
+
+// Learn glitch_cfg_t.timeout from how late eMMC traffic shows up after the pulse,
+// instead of always waiting CONFIG_DEFAULT_TIMEOUT units before giving up on a hang.
+#ifndef GLITCH_ADAPTIVE_TIMEOUT
+#define GLITCH_ADAPTIVE_TIMEOUT 1
+#endif
+
+#define GLITCH_TIMEOUT_UNIT_US 1200 // one unit of glitch_cfg_t.timeout
+#define GLITCH_TIMEOUT_MIN 4
+#define GLITCH_TIMEOUT_MIN_SAMPLES 16 // traffic observations before the learned value is used
+#define GLITCH_TIMEOUT_PROBE_INTERVAL 16 // every n-th attempt still waits the full default
+
+// Timeout to program for the next attempt, given the one it would use otherwise.
+uint8_t glitch_timeout_next(uint8_t timeout);
+
+// Account an attempt that was flagged elapsed_us after arming the FPGA.
+void glitch_timeout_add_result(uint8_t timeout, enum GLITCH_RESULT_TYPE result, uint32_t elapsed_us);
+
+// Learned timeout, 0 while still learning.
+uint8_t glitch_timeout_learned();
+
+// Upper quantile of the delay between pulse and end of eMMC traffic, in us.
+uint16_t glitch_timeout_latency_us();
+
+#endif
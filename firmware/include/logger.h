@@ -31,6 +31,7 @@ typedef struct
 	void (*end)();
 	void (*adc)(uint32_t value);
 	void (*stats)(uint32_t attempt, uint16_t offset, uint8_t width, uint8_t subcycle, uint8_t needs_reflash);
+	bool full_capture; // glitch_result() gets all captured eMMC traffic, not just what categorized the attempt
 } logger;
 
 extern logger null_logger;
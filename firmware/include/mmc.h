@@ -19,9 +19,38 @@
 
 #include <stdint.h>
 
+// Bring the card up after the short device reset first and only fall back to the 2s
+// clock-stuck reset when that fails; after one such failure for the rest of the power-on
+#ifndef MMC_FAST_RESET
+#define MMC_FAST_RESET 1
+#endif
+
+#define MMC_BLOCK_SIZE 512
+
+// How the last mmc_initialize() went
+typedef struct
+{
+	uint32_t reset_us; // device resets, the clock-stuck one included when it came to that
+	uint32_t op_cond_us; // first SEND_OP_COND until the card reported ready
+	uint32_t total_us;
+	uint8_t op_cond_polls;
+	uint8_t clock_stuck : 1; // the short reset was skipped or not enough
+	uint8_t reserved : 7;
+} __attribute__((packed)) mmc_bringup_t;
+
+extern mmc_bringup_t g_mmc_bringup;
+
+// CRC7 of command and response frames, shared with the bus sniffer
+int crc7(const uint8_t *buffer, int size);
+
 uint32_t mmc_initialize(uint8_t *cid);
+// Skip the short reset from the next mmc_initialize() on, for retries after a failure past it
+void mmc_escalate_reset();
 uint32_t mmc_read(uint32_t offset, uint8_t *block);
 uint32_t mmc_write(uint32_t offset, const uint8_t *block);
+// count consecutive blocks from offset, to and from count * MMC_BLOCK_SIZE bytes at blocks
+uint32_t mmc_read_blocks(uint32_t offset, uint32_t count, uint8_t *blocks);
+uint32_t mmc_write_blocks(uint32_t offset, uint32_t count, const uint8_t *blocks);
 uint32_t mmc_check_and_if_different_write(uint32_t offset, const uint8_t *buffer, uint32_t len);
 uint32_t mmc_check_and_if_header_different_write_all(uint32_t offset, const uint8_t *buffer, uint32_t len);
 uint32_t mmc_copy(uint32_t dest, uint32_t source, uint32_t len);
@@ -20,22 +20,66 @@
 
 #include <stdint.h>
 
-enum MMC_SNIFFER_PACKET_TYPE
+// Decoder for the eMMC bus traffic the FPGA captures after a glitch attempt. Every frame is
+// checked against its CRC7, responses are paired with the command they answer, and the
+// result is a list of events plus what the boot ROM got to.
+
+#define MMC_SNIFF_FRAME_LEN 6 // commands and all responses but R2
+#define MMC_SNIFF_R2_FRAME_LEN 17
+#define MMC_SNIFF_MAX_EVENTS 16
+
+// Sectors the boot ROM reads from BOOT0
+#define MMC_SNIFF_BCT_END_SECTOR 0x80 // four BCT copies at 0x00, 0x20, 0x40 and 0x60
+#define MMC_SNIFF_PAYLOAD_SECTOR 0x1F80
+
+enum MMC_SNIFF_EVENT_TYPE
 {
-	MMC_SNIFF_PKT_TYPE_INVALID = 0,
-	MMC_SNIFF_PKT_TYPE_COMMAND, // 48-bit command from host to device
-	MMC_SNIFF_PKT_TYPE_RESPONSE48, // 48-bit response from device
-	MMC_SNIFF_PKT_TYPE_RESPONSE136, // 136-bit response from device
+	MMC_SNIFF_EVENT_COMMAND = 0, // arg is the command argument
+	MMC_SNIFF_EVENT_RESPONSE = 1, // arg is the card status (R1), OCR (R3) or first CID/CSD word (R2)
+	MMC_SNIFF_EVENT_BAD_FRAME = 2, // bytes that don't form a frame with a valid CRC7, skipped
 };
 
+#define MMC_SNIFF_EVENT_UNPAIRED 0x01 // response to a command that was not seen or doesn't match
+
+typedef struct
+{
+	uint8_t type; // MMC_SNIFF_EVENT_TYPE
+	uint8_t cmd; // command index; for responses that of the command answered
+	uint8_t flags; // MMC_SNIFF_EVENT_*
+	uint8_t state; // card state after the event, R1_STATE_*, 0xFF if unknown
+	uint32_t arg;
+} mmc_sniff_event_t;
+
+// What the captured traffic shows the boot ROM doing
+#define MMC_SNIFF_SEEN_RESET 0x01 // GO_IDLE_STATE
+#define MMC_SNIFF_SEEN_IDENT 0x02 // SEND_OP_COND, ALL_SEND_CID or SET_RELATIVE_ADDR
+#define MMC_SNIFF_SEEN_BLOCK_READ 0x04 // any READ_SINGLE_BLOCK or READ_MULTIPLE_BLOCK
+#define MMC_SNIFF_SEEN_BCT_READ 0x08 // a read below MMC_SNIFF_BCT_END_SECTOR
+#define MMC_SNIFF_SEEN_PAYLOAD_READ 0x10 // a read at or above MMC_SNIFF_PAYLOAD_SECTOR
+
 typedef struct
 {
-	uint8_t *data;
-	uint32_t datalen;
-	uint8_t cmd;
-} mmc_sniff_parser_ctx;
+	mmc_sniff_event_t events[MMC_SNIFF_MAX_EVENTS];
+	uint8_t count; // events kept; later ones only update the fields below
+	uint8_t frames; // frames with a valid CRC7
+	uint8_t bad_frames;
+	uint8_t unpaired;
+	uint8_t seen; // MMC_SNIFF_SEEN_*
+	uint8_t state; // card state, R1_STATE_*, 0xFF if unknown
+	uint8_t pending_cmd; // command waiting for its response, 0xFF if none
+	uint8_t in_bad_frame; // skipping bytes since the last valid frame
+	uint8_t block_reads; // READ_SINGLE_BLOCK and READ_MULTIPLE_BLOCK commands, saturating
+	uint32_t last_sector; // argument of the last block read
+} mmc_sniff_t;
 
-void mmc_sniff_parser_init(mmc_sniff_parser_ctx *ctx, uint8_t *data, int datalen);
-enum MMC_SNIFFER_PACKET_TYPE mmc_sniff_parser_parse(mmc_sniff_parser_ctx *ctx);
+void mmc_sniff_init(mmc_sniff_t *sniff);
+// Bytes the frame at data takes, given the command it may answer. Looks at its first
+// MMC_SNIFF_FRAME_LEN bytes.
+unsigned int mmc_sniff_frame_length(const mmc_sniff_t *sniff, const uint8_t *data);
+// Decode the frame at data, at least mmc_sniff_frame_length() bytes of it.
+// Returns the bytes consumed: the frame, or 1 to resynchronize after a bad one.
+unsigned int mmc_sniff_frame(mmc_sniff_t *sniff, const uint8_t *data);
+// Decode a whole capture
+void mmc_sniff_decode(mmc_sniff_t *sniff, const uint8_t *data, unsigned int len);
 
-#endif
\ No newline at end of file
+#endif
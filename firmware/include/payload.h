@@ -17,11 +17,21 @@
 #ifndef __PAYLOAD_H__
 #define __PAYLOAD_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <device.h>
 #include <statuscode.h>
 
-enum STATUSCODE flash_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type);
+// BOOT0 sector recording the digest of the image the last complete flash_payload() wrote,
+// see tools/payload_digest.c
+#define PAYLOAD_STAMP_SECTOR 0x1FFF
+
+// Check every block of the BCTs and the payload and rewrite those that differ, then stamp
+// BOOT0. With trust_stamp, a matching stamp and first BCT block skip all of that.
+enum STATUSCODE flash_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type, bool trust_stamp);
+// Same as flash_payload(), but read back only a few blocks of every BCT and the payload
+// first, and only check and rewrite all of them if one of those differs
+enum STATUSCODE verify_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type);
 enum STATUSCODE erase_payload();
 
 #endif
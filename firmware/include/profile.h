@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeline of where the time from power-on to the payload goes, read out with
+// FW_SESSION_INFO and printed by the 'd' debug command. Spans may nest.
+enum PROFILE_PHASE
+{
+	PROFILE_FPGA_SYNC = 0, // waiting for the FPGA to drive PF7
+	PROFILE_FPGA_RESET,
+	PROFILE_FPGA_LINK, // SPI link test or training
+	PROFILE_TRAINING, // glitch sessions run to fill an empty config
+	PROFILE_DEVICE_DETECT, // device type, board and FPGA type
+	PROFILE_ADC_WAIT, // console power rail reaching a threshold
+	PROFILE_DEVICE_RESET, // console reset to retry reaching it
+	PROFILE_PAYLOAD_FLASH,
+	PROFILE_PAYLOAD_VERIFY,
+	PROFILE_CONFIG_SAVE, // flash writes of the config journal
+	PROFILE_GLITCH, // offset reuse and search, up to the result
+	PROFILE_PHASE_COUNT,
+};
+
+// Bounded waits for a condition that used to be a fixed delay, to tighten their bounds from
+// the latencies seen on units in the field
+enum PROFILE_WAIT
+{
+	PROFILE_WAIT_SYNC_PULL_UP = 0, // PF7 following the pull-up, FPGA not holding it low
+	PROFILE_WAIT_SYNC_PULL_DOWN, // PF7 following the pull-down, FPGA not driving it high
+	PROFILE_WAIT_FPGA_STATUS, // FPGA status pin through configuration after power-on
+	PROFILE_WAIT_COUNT,
+};
+
+#define PROFILE_MAX_SPANS 32
+#define PROFILE_OPEN 0xFFFFFFFF // duration of a span not ended yet
+
+typedef struct
+{
+	uint8_t phase; // PROFILE_PHASE
+	uint32_t start_us; // timer_get_global_total()
+	uint32_t duration_us;
+} __attribute__((packed)) profile_span_t;
+
+typedef struct
+{
+	uint16_t count;
+	uint32_t total_us;
+} __attribute__((packed)) profile_total_t;
+
+typedef struct
+{
+	uint16_t count;
+	uint16_t timeouts; // waits that ran into the bound
+	uint32_t max_us; // of the waits that didn't
+} __attribute__((packed)) profile_wait_t;
+
+typedef struct
+{
+	uint8_t span_count;
+	uint8_t spans_dropped; // saturating, once the table is full
+	profile_span_t spans[PROFILE_MAX_SPANS]; // the first ones, in start order
+	profile_total_t totals[PROFILE_PHASE_COUNT]; // of all spans, dropped ones included
+	profile_wait_t waits[PROFILE_WAIT_COUNT];
+} __attribute__((packed)) profile_t;
+
+extern profile_t g_profile;
+
+void profile_reset();
+// Returns the start of the span, to be passed to profile_end() with the same phase
+uint32_t profile_begin(enum PROFILE_PHASE phase);
+void profile_end(enum PROFILE_PHASE phase, uint32_t start_us);
+const char *profile_phase_name(enum PROFILE_PHASE phase);
+void profile_wait(enum PROFILE_WAIT site, bool ready, uint32_t waited_us);
+const char *profile_wait_name(enum PROFILE_WAIT site);
+
+#endif
@@ -2,6 +2,7 @@
 #define __SDIO_H__
 
 #include "session_info.h"
+#include "profile.h"
 #include "config.h"
 
 enum FW_COMMAND
@@ -17,6 +18,28 @@ enum FW_COMMAND
 
 #define TRAIN_DATA_RESET_MAGIC 0x14CCB847
 #define TRAIN_DATA_SET_MAGIC 0xC88350AE
+// Train data in train_data_v2_t format; FW_GET_TRAIN_DATA answers in v1 format unless asked with this magic
+#define TRAIN_DATA_GET_V2_MAGIC 0x2F6B1DE0
+#define TRAIN_DATA_SET_V2_MAGIC 0xC88350AF
+
+typedef struct
+{
+	uint16_t offset;
+	uint8_t width;
+	uint8_t subcycle_delay;
+	uint8_t timeout;
+	uint8_t subcycle_hits[4];
+	uint32_t success;
+} __attribute__((packed)) train_timing_v2_t;
+
+typedef struct
+{
+	uint32_t magic; // CONFIG_MAGIC
+	uint8_t count;
+	uint8_t reflash;
+	uint16_t boot_count;
+	train_timing_v2_t timings[CONFIG_MAX_TIMINGS];
+} __attribute__((packed)) train_data_v2_t;
 
 typedef struct
 {
@@ -24,8 +47,12 @@ typedef struct
 	struct
 	{
 		uint32_t magic;
-		config_t cfg;
-	} train_data;
+		union
+		{
+			config_v1_t cfg;
+			train_data_v2_t cfg_v2;
+		};
+	} __attribute__((packed)) train_data;
 } __attribute__((packed)) sdio_req_t;
 
 typedef struct
@@ -40,12 +67,17 @@ typedef struct
 			uint32_t magic : 24;
 			uint32_t format : 8;
 			session_info_t data;
+			profile_t timeline; // boot phases and waits of this session, see profile.h
 		} session_info;
 		struct
 		{
 			uint32_t load_result;
-			config_t cfg;
-		} train_data;
+			union
+			{
+				config_v1_t cfg;
+				train_data_v2_t cfg_v2;
+			};
+		} __attribute__((packed)) train_data;
 	};
 } __attribute__((packed)) sdio_resp_t;
 
@@ -21,8 +21,9 @@
 #include <fpga.h>
 #include <device.h>
 #include <board_id.h>
+#include <mmc.h>
 
-#define SESSION_INFO_FORMAT_VER 2
+#define SESSION_INFO_FORMAT_VER 3
 #define SESSION_INFO_MAGIC 0x80B54D
 
 typedef struct
@@ -38,7 +39,8 @@ typedef struct
 
 	uint8_t was_the_device_reset : 1;
 	uint8_t payload_flashed : 1;
-	uint8_t reserved : 6;
+	uint8_t first_timing_success : 1; // won by the first stored timing tried
+	uint8_t reserved : 5;
 
 	enum DEVICE_TYPE device_type;
 	enum BOARD_ID board_id;
@@ -46,6 +48,12 @@ typedef struct
 
 	glitch_cfg_t glitch_cfg;
 
+	uint8_t learned_timeout; // adaptive glitch timeout, 0 while still learning
+	uint16_t traffic_latency_us; // upper quantile of eMMC traffic latency after the pulse
+
+	mmc_bringup_t mmc_bringup; // of the last payload flash or verify
+	uint32_t payload_program_us; // that flash or verify as a whole
+
 } __attribute__((packed)) session_info_t;
 
 extern session_info_t g_session_info;
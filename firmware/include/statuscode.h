@@ -63,6 +63,10 @@ enum STATUSCODE
 	ERR_MMC_STATE_UNEXPECTED_NOT_TRAN4 = 0xBAD0011E,
 	ERR_MMC_WRITE_SINGLE_BLOCK_FAILED = 0xBAD00120,
 	ERR_MMC_STATE_UNEXPECTED_NOT_TRAN5 = 0xBAD00121,
+	ERR_MMC_SEND_EXT_CSD_FAILED = 0xBAD0012A,
+	ERR_MMC_STATE_UNEXPECTED_NOT_TRAN7 = 0xBAD0012B,
+	ERR_MMC_ERASE_FAILED = 0xBAD0012C,
+	ERR_MMC_ERASE_TIMEOUT = 0xBAD0012D,
 };
 
 
@@ -3,11 +3,18 @@
 
 #include <stdint.h>
 
+#define TIMER_CYCLES_PER_US 96 // core clock, also the clock of the APB timers
+
+// Microseconds are counted by TIMER1 running free at 1 MHz, no interrupt or polling needed.
+// Both clocks wrap after 71 minutes; differences of them are right across a wrap.
 void timer_global_init();
 void timer2_init();
 uint32_t timer_global_get_us();
 uint32_t timer2_get_us();
-uint32_t timer_get_global_total();
-uint32_t timer2_get_total();
+uint32_t timer_get_global_total(); // since timer_global_init()
+uint32_t timer2_get_total(); // since timer2_init(), the start of a glitch session
+
+// Core clock cycles, for measuring short intervals exactly. Wraps after 44 s.
+uint32_t timer_cycles();
 
-#endif
\ No newline at end of file
+#endif
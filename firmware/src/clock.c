@@ -27,6 +27,7 @@ void clocks_init()
 
 	// FPGA
 	rcu_periph_clock_enable(RCU_SPI0);
+	rcu_periph_clock_enable(RCU_DMA);
 
 	// FPGA Sync
 	rcu_periph_clock_enable(RCU_GPIOF);
@@ -16,57 +16,183 @@
 
 #include <gd32f3x0.h>
 #include <config.h>
+#include <profile.h>
 #include <statuscode.h>
+#include <stdbool.h>
 #include <string.h>
 
+#define Q16_HALF 0x8000
+
+#define CONFIG_JOURNAL_MAGIC 0x4A584E54
+
+enum CONFIG_RECORD_TYPE
+{
+	CONFIG_RECORD_TIMING = 0x01,       // one slot of timings[]
+	CONFIG_RECORD_STATE = 0x02,        // count, reflash and boot_count; closes a save
+	CONFIG_RECORD_LINK = 0x03,         // FPGA link settings
+};
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t seq;                // increments with every compaction
+} config_page_header_t;
+
+typedef struct
+{
+	uint8_t type;                // CONFIG_RECORD_TYPE, 0xFF for erased flash
+	uint8_t index;               // timings[] slot
+	uint16_t crc;                // over type, index and payload
+} config_record_t;
+
+typedef struct
+{
+	uint8_t count;
+	uint8_t reflash;
+	uint16_t boot_count;
+} config_state_t;
+
+typedef struct
+{
+	uint8_t spi_divider;
+	uint8_t reserved[3];
+} config_link_t;
+
+static config_t g_config;        // latest config, see g_pending
+static bool g_config_ready = false;
+static bool g_pending;           // g_config has changes not written to flash yet
+static uint32_t g_dirty;         // timings[] slots among them
+static bool g_link_dirty;        // and whether the link settings changed
+static int g_page = -1;          // journal page being appended to, -1 if none
+static uint32_t g_page_seq;
+static uint32_t g_write_offset;  // next free byte in g_page
+
 void config_clear(config_t *cfg)
 {
 	memset(cfg->timings, 0xFF, sizeof(cfg->timings));
 	cfg->magic = 0;
 	cfg->count = 0;
+	cfg->reflash = 0;
+	cfg->boot_count = 0;
+	cfg->spi_divider = 0;
 }
 
-enum STATUSCODE config_load(config_t *cfg)
+static void config_timing_defaults(timing_t *timing)
+{
+	timing->subcycle_delay = 0;
+	timing->timeout = CONFIG_DEFAULT_TIMEOUT;
+	memset(timing->subcycle_hits, 0, sizeof(timing->subcycle_hits));
+}
+
+void config_from_v1(config_t *cfg, const config_v1_t *in)
 {
-	memcpy(cfg, (const void *)0x801FC00, sizeof(config_t));
-	if (cfg->magic != CONFIG_MAGIC)
+	config_clear(cfg);
+	cfg->magic = CONFIG_MAGIC;
+	cfg->count = in->count > CONFIG_MAX_TIMINGS ? CONFIG_MAX_TIMINGS : in->count; // may come from the host
+	cfg->reflash = in->reflash;
+
+	// Copy unused entries too, they terminate the table.
+	// History starts out empty; lifetime successes keep the old order until it builds up.
+	for (int i = 0; i < CONFIG_MAX_TIMINGS; i++)
 	{
-		config_clear(cfg);
-		return ERR_CONFIG_NOT_FILLED;
+		timing_t *t = &cfg->timings[i];
+		t->offset = in->timings[i].offset;
+		t->width = in->timings[i].width;
+		t->success = in->timings[i].success;
+		t->fail_streak = 0;
+		t->attempts = 0;
+		t->failures = 0;
+		t->last_success_boot = 0;
+		config_timing_defaults(t);
 	}
+}
 
-	int i = 0;
-	for (; i < 32; ++i)
+void config_to_v1(const config_t *cfg, config_v1_t *out)
+{
+	memset(out, 0xFF, sizeof(config_v1_t));
+	out->magic = CONFIG_MAGIC_V1;
+	out->count = cfg->count;
+	out->reflash = cfg->reflash;
+
+	for (int i = 0; i < cfg->count; i++)
 	{
-		if (cfg->timings[i].width == 0xFF)
-			break;
-		if (cfg->timings[i].offset == 0xFFFF)
-			break;
+		out->timings[i].offset = cfg->timings[i].offset;
+		out->timings[i].width = cfg->timings[i].width;
+		out->timings[i].success = cfg->timings[i].success;
 	}
-	cfg->count = i;
+}
 
-	return i ? OK_CONFIG : ERR_CONFIG_NOT_FILLED;
+uint32_t config_timing_score(const timing_t *timing)
+{
+	// Laplace estimate: timings without history rank at 1/2
+	uint32_t successes = timing->attempts - timing->failures;
+	return ((successes + 1) << 16) / (timing->attempts + 2);
+}
+
+void config_timing_add_attempts(timing_t *timing, unsigned int attempts, unsigned int failures)
+{
+	uint32_t total = timing->attempts + attempts;
+	uint32_t failed = timing->failures + failures;
+	while (total >= CONFIG_DECAY_ATTEMPTS)
+	{
+		total >>= 1;
+		failed >>= 1;
+	}
+	timing->attempts = total;
+	timing->failures = failed;
 }
 
 enum STATUSCODE config_add_new(config_t *cfg, glitch_cfg_t *new_cfg)
 {
+	timing_t *timing = 0;
 	for (int i = 0; i < cfg->count; i++)
 	{
 		if (new_cfg->offset == cfg->timings[i].offset && new_cfg->width == cfg->timings[i].width)
 		{
-			cfg->timings[i].success++;
-			return OK_CONFIG;
+			timing = &cfg->timings[i];
+			break;
 		}
 	}
 
-	unsigned int idx = cfg->count;
-	if (idx >= 32)
-		return ERR_CONFIG_TABLE_FULL;
+	if (!timing)
+	{
+		unsigned int idx = cfg->count;
+		if (idx >= CONFIG_MAX_TIMINGS)
+		{
+			// Replace the timing least likely to work
+			idx = 0;
+			for (int i = 1; i < cfg->count; i++)
+			{
+				if (config_timing_score(&cfg->timings[i]) < config_timing_score(&cfg->timings[idx]))
+					idx = i;
+			}
+			if (config_timing_score(&cfg->timings[idx]) >= Q16_HALF)
+				return ERR_CONFIG_TABLE_FULL;
+		}
+		else
+			cfg->count++;
+
+		timing = &cfg->timings[idx];
+		memset(timing, 0, sizeof(timing_t));
+		timing->offset = new_cfg->offset;
+		timing->width = new_cfg->width;
+	}
 
-	cfg->timings[idx].offset = new_cfg->offset;
-	cfg->timings[idx].width = new_cfg->width;
-	cfg->timings[idx].success = 1;
-	cfg->count++;
+	timing->success++;
+	timing->fail_streak = 0;
+	timing->last_success_boot = cfg->boot_count;
+	timing->timeout = new_cfg->timeout;
+	config_timing_add_attempts(timing, 1, 0);
+
+	uint8_t *hits = timing->subcycle_hits;
+	if (hits[new_cfg->subcycle_delay & 3] == 0xFF)
+	{
+		for (int k = 0; k < 4; k++)
+			hits[k] >>= 1;
+	}
+	hits[new_cfg->subcycle_delay & 3]++;
+	if (hits[new_cfg->subcycle_delay & 3] > hits[timing->subcycle_delay & 3])
+		timing->subcycle_delay = new_cfg->subcycle_delay & 3;
 
 	return OK_CONFIG;
 }
@@ -107,36 +233,333 @@ char burn_flash(uint8_t *dest, uint8_t *src, uint32_t len)
 	return 1;
 }
 
-enum STATUSCODE config_save(config_t *cfg)
+static uint16_t crc16(uint16_t crc, const uint8_t *data, unsigned int len)
 {
-	cfg->magic = CONFIG_MAGIC;
+	// CRC-16/CCITT
+	while (len--)
+	{
+		crc ^= *data++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static unsigned int config_record_length(uint8_t type)
+{
+	switch (type)
+	{
+		case CONFIG_RECORD_TIMING:
+			return sizeof(timing_t);
+		case CONFIG_RECORD_STATE:
+			return sizeof(config_state_t);
+		case CONFIG_RECORD_LINK:
+			return sizeof(config_link_t);
+		default:
+			return 0;
+	}
+}
+
+static uint16_t config_record_crc(const config_record_t *rec)
+{
+	uint16_t crc = crc16(0xFFFF, &rec->type, 2);
+	return crc16(crc, (const uint8_t *)(rec + 1), config_record_length(rec->type));
+}
+
+static const config_page_header_t *config_page(unsigned int page)
+{
+	return (const config_page_header_t *)(CONFIG_JOURNAL_START + page * CONFIG_PAGE_SIZE);
+}
+
+static bool config_page_valid(unsigned int page)
+{
+	const config_page_header_t *hdr = config_page(page);
+	return hdr->magic == CONFIG_JOURNAL_MAGIC && hdr->seq != 0xFFFFFFFF;
+}
+
+// Replay the records of a journal page into cfg. Timing records only take effect
+// once the state record closing their save has been read.
+// Returns the offset at which the next record can be appended.
+static uint32_t config_journal_replay(unsigned int page, config_t *cfg)
+{
+	const uint8_t *base = (const uint8_t *)config_page(page);
+	config_t pending = *cfg;
+
+	uint32_t offset = sizeof(config_page_header_t);
+	while (offset + sizeof(config_record_t) <= CONFIG_PAGE_SIZE)
+	{
+		const config_record_t *rec = (const config_record_t *)(base + offset);
+		unsigned int len = config_record_length(rec->type);
+		if (!len || offset + sizeof(config_record_t) + len > CONFIG_PAGE_SIZE ||
+			rec->index >= CONFIG_MAX_TIMINGS || rec->crc != config_record_crc(rec))
+		{
+			// Anything but erased flash is a torn write; don't append after it
+			if (*(const uint32_t *)rec != 0xFFFFFFFF)
+				offset = CONFIG_PAGE_SIZE;
+			break;
+		}
+
+		if (rec->type == CONFIG_RECORD_TIMING)
+			memcpy(&pending.timings[rec->index], rec + 1, sizeof(timing_t));
+		else if (rec->type == CONFIG_RECORD_LINK)
+			pending.spi_divider = ((const config_link_t *)(rec + 1))->spi_divider;
+		else
+		{
+			const config_state_t *state = (const config_state_t *)(rec + 1);
+			pending.magic = CONFIG_MAGIC;
+			pending.count = state->count > CONFIG_MAX_TIMINGS ? CONFIG_MAX_TIMINGS : state->count;
+			pending.reflash = state->reflash;
+			pending.boot_count = state->boot_count;
+			memset(&pending.timings[pending.count], 0xFF, (CONFIG_MAX_TIMINGS - pending.count) * sizeof(timing_t));
+			*cfg = pending;
+		}
+
+		offset += sizeof(config_record_t) + len;
+	}
+
+	return offset;
+}
+
+static bool config_journal_append(uint8_t type, uint8_t index, const void *payload)
+{
+	uint32_t buf[(sizeof(config_record_t) + sizeof(timing_t)) / 4];
+	config_record_t *rec = (config_record_t *)buf;
+	unsigned int len = config_record_length(type);
+	rec->type = type;
+	rec->index = index;
+	memcpy(rec + 1, payload, len);
+	rec->crc = config_record_crc(rec);
+
+	uint32_t size = sizeof(config_record_t) + len;
+	if (g_page < 0 || g_write_offset + size > CONFIG_PAGE_SIZE ||
+		!burn_flash((uint8_t *)config_page(g_page) + g_write_offset, (uint8_t *)buf, size))
+	{
+		g_write_offset = CONFIG_PAGE_SIZE;
+		return false;
+	}
 
+	g_write_offset += size;
+	return true;
+}
+
+static bool config_journal_append_state(const config_t *cfg)
+{
+	config_state_t state = {cfg->count, cfg->reflash, cfg->boot_count};
+	return config_journal_append(CONFIG_RECORD_STATE, 0, &state);
+}
+
+static bool config_journal_append_link(const config_t *cfg)
+{
+	config_link_t link = {cfg->spi_divider};
+	return config_journal_append(CONFIG_RECORD_LINK, 0, &link);
+}
+
+// Start the next page of the ring with a snapshot of cfg. The page header is
+// programmed last, so the page only becomes valid once the snapshot is complete.
+static enum STATUSCODE config_journal_compact(const config_t *cfg)
+{
+	unsigned int page = g_page < 0 ? 0 : (g_page + 1) % CONFIG_JOURNAL_PAGES;
+	if (!erase_flash((uint8_t *)config_page(page)))
+		return ERR_FLASH_ERASE_FAIL;
+
+	g_page = page;
+	g_write_offset = sizeof(config_page_header_t);
 	for (int i = 0; i < cfg->count; i++)
 	{
-		for (int j = 0; j < cfg->count; j++)
+		if (!config_journal_append(CONFIG_RECORD_TIMING, i, &cfg->timings[i]))
+			return ERR_FLASH_WRITE_FAIL;
+	}
+	if (cfg->spi_divider && !config_journal_append_link(cfg))
+		return ERR_FLASH_WRITE_FAIL;
+	if (!config_journal_append_state(cfg))
+		return ERR_FLASH_WRITE_FAIL;
+
+	config_page_header_t hdr = {CONFIG_JOURNAL_MAGIC, g_page_seq + 1};
+	if (!burn_flash((uint8_t *)config_page(page), (uint8_t *)&hdr, sizeof(hdr)))
+		return ERR_FLASH_WRITE_FAIL;
+
+	g_page_seq++;
+	return OK_CONFIG;
+}
+
+static void config_migrate_legacy()
+{
+	// Older firmware kept a plain table in the last journal page
+	if (*(const uint32_t *)CONFIG_LEGACY_ADDRESS != CONFIG_MAGIC_V1)
+		return;
+
+	config_t cfg;
+	config_from_v1(&cfg, (const config_v1_t *)CONFIG_LEGACY_ADDRESS);
+
+	int i = 0;
+	for (; i < CONFIG_MAX_TIMINGS; ++i)
+	{
+		if (cfg.timings[i].width == 0xFF)
+			break;
+		if (cfg.timings[i].offset == 0xFFFF)
+			break;
+	}
+	cfg.count = i;
+
+	if (config_journal_compact(&cfg) == OK_CONFIG)
+		g_config = cfg;
+}
+
+// Build the RAM copy of the config once. The newest valid journal page holds a
+// snapshot followed by all updates since; older pages are only used if it is damaged.
+static void config_init()
+{
+	if (g_config_ready)
+		return;
+	g_config_ready = true;
+
+	config_clear(&g_config);
+	g_pending = false;
+	g_dirty = 0;
+	g_link_dirty = false;
+	g_page = -1;
+	g_page_seq = 0;
+
+	uint32_t tried = 0;
+	for (;;)
+	{
+		int newest = -1;
+		for (unsigned int page = 0; page < CONFIG_JOURNAL_PAGES; page++)
 		{
-			if (cfg->timings[i].success > cfg->timings[j].success)
+			if (!config_page_valid(page))
+				continue;
+			if (g_page < 0 || (int32_t)(config_page(page)->seq - g_page_seq) > 0)
 			{
-				timing_t tmp = cfg->timings[i];
-				cfg->timings[i] = cfg->timings[j];
-				cfg->timings[j] = tmp;
+				// Continue numbering after the newest page, even if it turns out to be damaged
+				g_page = page;
+				g_page_seq = config_page(page)->seq;
 			}
+			if (!(tried & (1 << page)) && (newest < 0 || (int32_t)(config_page(page)->seq - config_page(newest)->seq) > 0))
+				newest = page;
+		}
+		if (newest < 0)
+			break;
+
+		tried |= 1 << newest;
+		uint32_t offset = config_journal_replay(newest, &g_config);
+		if (g_config.magic == CONFIG_MAGIC)
+		{
+			// Appending to an older page would lose the newer ones; compact on next save instead
+			g_write_offset = newest == g_page ? offset : CONFIG_PAGE_SIZE;
+			return;
 		}
 	}
 
-	if (!erase_flash((uint8_t *)0x801FC00))
-		return ERR_FLASH_ERASE_FAIL;
+	g_write_offset = CONFIG_PAGE_SIZE;
+	if (g_page < 0)
+		config_migrate_legacy();
+}
 
-	if (!burn_flash((uint8_t *) 0x801FC00, (uint8_t *) cfg, sizeof(config_t)))
-		return ERR_FLASH_WRITE_FAIL;
+const config_t *config_get()
+{
+	config_init();
+	return &g_config;
+}
 
+enum STATUSCODE config_load(config_t *cfg)
+{
+	*cfg = *config_get();
+	return cfg->count ? OK_CONFIG : ERR_CONFIG_NOT_FILLED;
+}
+
+static void config_stage_changes(config_t *cfg)
+{
+	cfg->magic = CONFIG_MAGIC;
+	for (int i = 0; i < cfg->count; i++)
+	{
+		if (memcmp(&cfg->timings[i], &g_config.timings[i], sizeof(timing_t)))
+			g_dirty |= 1u << i;
+	}
+	if (cfg->spi_divider != g_config.spi_divider)
+		g_link_dirty = true;
+
+	g_config = *cfg;
+	memset(&g_config.timings[cfg->count], 0xFF, (CONFIG_MAX_TIMINGS - cfg->count) * sizeof(timing_t));
+	g_pending = true;
+}
+
+bool config_pending()
+{
+	return g_pending;
+}
+
+static enum STATUSCODE config_write_pending()
+{
+	// Append the changed slots followed by a state record closing the save.
+	// Only if they don't fit into the current page the table is compacted into the next one.
+	unsigned int changed = 0;
+	for (int i = 0; i < g_config.count; i++)
+		changed += (g_dirty >> i) & 1;
+
+	uint32_t size = changed * (sizeof(config_record_t) + sizeof(timing_t)) + sizeof(config_record_t) + sizeof(config_state_t);
+	if (g_link_dirty)
+		size += sizeof(config_record_t) + sizeof(config_link_t);
+	bool appended = g_write_offset + size <= CONFIG_PAGE_SIZE;
+	for (int i = 0; appended && i < g_config.count; i++)
+	{
+		if (g_dirty & (1u << i))
+			appended = config_journal_append(CONFIG_RECORD_TIMING, i, &g_config.timings[i]);
+	}
+	if (g_link_dirty)
+		appended = appended && config_journal_append_link(&g_config);
+	appended = appended && config_journal_append_state(&g_config);
+
+	if (!appended)
+	{
+		enum STATUSCODE result = config_journal_compact(&g_config);
+		if (result != OK_CONFIG)
+			return result;
+	}
+
+	g_dirty = 0;
+	g_link_dirty = false;
+	g_pending = false;
 	return OK_CONFIG;
 }
 
+enum STATUSCODE config_commit()
+{
+	config_init();
+	if (!g_pending)
+		return OK_CONFIG;
+
+	uint32_t span = profile_begin(PROFILE_CONFIG_SAVE);
+	enum STATUSCODE result = config_write_pending();
+	profile_end(PROFILE_CONFIG_SAVE, span);
+	return result;
+}
+
+enum STATUSCODE config_stage(config_t *cfg)
+{
+	config_init();
+
+	// Keep at most one update in RAM
+	enum STATUSCODE result = config_commit();
+	config_stage_changes(cfg);
+	return result;
+}
+
+enum STATUSCODE config_save(config_t *cfg)
+{
+	config_init();
+	config_stage_changes(cfg);
+	return config_commit();
+}
+
 enum STATUSCODE config_reset()
 {
-	if (!erase_flash((void *)0x801FC00))
-		return ERR_CONFIG_RESET_FAIL;
+	enum STATUSCODE result = OK_CONFIG_RESET;
+	for (unsigned int page = 0; page < CONFIG_JOURNAL_PAGES; page++)
+	{
+		if (!erase_flash((uint8_t *)config_page(page)))
+			result = ERR_CONFIG_RESET_FAIL;
+	}
 
-	return OK_CONFIG_RESET;
-}
\ No newline at end of file
+	g_config_ready = false;
+	return result;
+}
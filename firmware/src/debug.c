@@ -24,8 +24,10 @@
 #include <glitch.h>
 #include <clock.h>
 #include <payload.h>
+#include <profile.h>
 #include <timer.h>
 #include <sdio.h>
+#include <mmc_sniffer.h>
 #include <statuscode.h>
 #include <string.h>
 #include <sprintf.h>
@@ -118,6 +120,25 @@ void dbg_logger_glitch_result(glitch_cfg_t *new_cfg, uint8_t glitch_res, uint8_t
 		dbglog("%02X", data[i]);
 	}
 	dbglog("\n");
+
+	if (!datalen)
+		return;
+
+	mmc_sniff_t sniff;
+	mmc_sniff_init(&sniff);
+	mmc_sniff_decode(&sniff, data, datalen);
+	dbglog("  emmc:");
+	for (int i = 0; i < sniff.count; ++i)
+	{
+		const mmc_sniff_event_t *ev = &sniff.events[i];
+		if (ev->type == MMC_SNIFF_EVENT_COMMAND)
+			dbglog(" CMD%d(%X)", ev->cmd, (unsigned int)ev->arg);
+		else if (ev->type == MMC_SNIFF_EVENT_RESPONSE)
+			dbglog(" R%s%d(%X)", (ev->flags & MMC_SNIFF_EVENT_UNPAIRED) ? "?" : "", ev->cmd, (unsigned int)ev->arg);
+		else
+			dbglog(" BAD");
+	}
+	dbglog(" seen %x state %d\n", sniff.seen, sniff.state);
 }
 
 void dbg_logger_end()
@@ -145,7 +166,8 @@ logger dbg_logger =
 	dbg_logger_glitch_result,
 	dbg_logger_end,
 	dbg_logger_adc,
-	dbg_logger_stats
+	dbg_logger_stats,
+	true
 };
 
 int wait_for_power_on(enum DEVICE_TYPE *pdt)
@@ -182,6 +204,35 @@ int reset_device_and_wait_for_power_on()
 	return OK_FPGA_RESET;
 }
 
+void debug_print_timeline()
+{
+	dbglog("# Timeline:\n");
+	for (int i = 0; i < g_profile.span_count; i++)
+	{
+		const profile_span_t *span = &g_profile.spans[i];
+		if (span->duration_us == PROFILE_OPEN)
+			dbglog("#  @%9u us  %s not ended\n", (unsigned int)span->start_us, profile_phase_name(span->phase));
+		else
+			dbglog("#  @%9u us  %s %u us\n", (unsigned int)span->start_us, profile_phase_name(span->phase), (unsigned int)span->duration_us);
+	}
+	if (g_profile.spans_dropped)
+		dbglog("#  %u more spans not kept\n", (unsigned int)g_profile.spans_dropped);
+
+	for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++)
+	{
+		const profile_total_t *total = &g_profile.totals[phase];
+		if (total->count)
+			dbglog("# %s: %u us in %u\n", profile_phase_name(phase), (unsigned int)total->total_us, (unsigned int)total->count);
+	}
+	for (int site = 0; site < PROFILE_WAIT_COUNT; site++)
+	{
+		const profile_wait_t *wait = &g_profile.waits[site];
+		if (wait->count)
+			dbglog("# %s wait: up to %u us in %u, %u timed out\n", profile_wait_name(site), (unsigned int)wait->max_us,
+				(unsigned int)wait->count, (unsigned int)wait->timeouts);
+	}
+}
+
 void debug_led_blink_success()
 {
 	// Green for 2s, then back to USB indicator
@@ -254,7 +305,7 @@ void debug_main(struct bootloader_usb *usb)
 					status = wait_for_power_on(&dt);
 					if (status == OK_FPGA_RESET)
 					{
-						status = flash_payload(cid, dt);
+						status = flash_payload(cid, dt, false);
 						if (status == OK_FLASH_SUCCESS)
 							debug_led_blink_success();
 					}
@@ -273,12 +324,22 @@ void debug_main(struct bootloader_usb *usb)
 			{
 				dbglog("# Diagnosing...\n");
 
+				profile_reset();
 				enum STATUSCODE status = fpga_reset();
 				session_info_t si = {0};
+				uint32_t spi_transactions = fpga_spi_transactions;
 				if (status == OK_FPGA_RESET)
 					status = glitch(&dbg_logger, &si, false);
 
 				dbglog("# Diagnose status: %08X\n", status);
+				dbglog("# SPI transactions: %u\n", (unsigned int)(fpga_spi_transactions - spi_transactions));
+				if (si.payload_program_us)
+				{
+					dbglog("# Payload: %u us, eMMC bring-up %u us (%s reset %u us, OP_COND %u us in %d polls)\n",
+						(unsigned int)si.payload_program_us, (unsigned int)si.mmc_bringup.total_us, si.mmc_bringup.clock_stuck ? "clock-stuck" : "short",
+						(unsigned int)si.mmc_bringup.reset_us, (unsigned int)si.mmc_bringup.op_cond_us, si.mmc_bringup.op_cond_polls);
+				}
+				debug_print_timeline();
 				if (status == ERR_UNKNOWN_DEVICE)
 					dbglog("# Please make sure console is powered on\n");
 				else if (status == OK_GLITCH_SUCCESS)
@@ -319,10 +380,12 @@ void debug_main(struct bootloader_usb *usb)
 
 				enum STATUSCODE status = fpga_reset();
 				session_info_t si = {0};
+				uint32_t spi_transactions = fpga_spi_transactions;
 				if (status == OK_FPGA_RESET)
 					status = glitch(&dbg_logger, &si, false);
 
 				dbglog("# Diagnose status: %08X\n", status);
+				dbglog("# SPI transactions: %u\n", (unsigned int)(fpga_spi_transactions - spi_transactions));
 				if (status == ERR_UNKNOWN_DEVICE)
 					dbglog("# Please make sure console is powered on\n");
 				else if (status == OK_GLITCH_SUCCESS)
@@ -366,22 +429,25 @@ void debug_main(struct bootloader_usb *usb)
 				uint32_t status = fpga_reset();
 				if (status == OK_FPGA_RESET)
 				{
-					int trains_left = 50;
+					glitch_train_t train;
+					glitch_train_init(&train);
+					bool trained;
 					session_info_t si = {0};
 					do
 					{
 						status = glitch(&dbg_logger, &si, true);
+						trained = glitch_train_add(&train, status, &si);
 						if (status == OK_GLITCH_SUCCESS)
 						{
-							trains_left--;
 							leds_override(100 , &lp_glitch_done);
-							dbglog("Train step successful; steps left: %d\n", trains_left);
+							dbglog("Train step %d successful; first timing won %d of %d sessions\n",
+								train.successes, train.hits, train.sessions);
 						}
-					} while (trains_left && status == OK_GLITCH_SUCCESS);
+					} while (!trained && status == OK_GLITCH_SUCCESS);
 
-					if (trains_left == 0)
+					if (trained && status == OK_GLITCH_SUCCESS)
 					{
-						dbglog("# Success; all training attempts completed!\n");
+						dbglog("# Success; training completed after %d steps!\n", train.successes);
 					}
 				}
 				if (status == ERR_UNKNOWN_DEVICE)
@@ -397,9 +463,10 @@ void debug_main(struct bootloader_usb *usb)
 				dbglog("# Status: %08X\n", status);
 				if (status == OK_CONFIG)
 				{
-					dbglog("# Config count: %d\n", cfg.count);
+					dbglog("# Config count: %u, sessions: %d\n", (unsigned int)cfg.count, cfg.boot_count);
 					for (int i = 0; i < cfg.count; ++i)
-						dbglog("# %02d: [%d, %d] %d\n", i, cfg.timings[i].offset, cfg.timings[i].width, cfg.timings[i].success);
+						dbglog("# %02d: [%d, %d] %u, %d/%d failed, streak %d, last success @%d\n", i, cfg.timings[i].offset, cfg.timings[i].width, (unsigned int)cfg.timings[i].success,
+							cfg.timings[i].failures, cfg.timings[i].attempts, cfg.timings[i].fail_streak, cfg.timings[i].last_success_boot);
 				}
 				break;
 			}
@@ -426,6 +493,53 @@ void debug_main(struct bootloader_usb *usb)
 				}
 				break;
 			}
+			case 'f':
+			{
+				dbglog("# FPGA SPI throughput at %d MHz, 512-byte buffer reads...\n", 48 / fpga_link_get());
+				if (fpga_reset() != OK_FPGA_RESET)
+				{
+					dbglog("# FPGA reset failed\n");
+					break;
+				}
+
+				const unsigned int blocks = 64;
+				uint8_t block[512];
+				fpga_select_active_buffer(FPGA_BUFFER_RESP_DATA);
+				for (int dma = 0; dma < 2; dma++)
+				{
+					fpga_spi_dma_enabled = dma;
+					uint32_t start = timer_cycles();
+					for (unsigned int i = 0; i < blocks; i++)
+						fpga_read_buffer(block, sizeof(block));
+					uint32_t cycles = timer_cycles() - start;
+					uint32_t us = cycles / TIMER_CYCLES_PER_US;
+					if (!us)
+						us = 1;
+					dbglog("#  %s: %u cycles per block, %u kB/s\n", dma ? "DMA   " : "polled", (unsigned int)(cycles / blocks),
+						(unsigned int)(blocks * sizeof(block) * 1000 / us));
+				}
+				fpga_spi_dma_enabled = 1;
+				break;
+			}
+			case 'l':
+			{
+				dbglog("# Training FPGA SPI link...\n");
+				if (fpga_reset() != OK_FPGA_RESET)
+				{
+					dbglog("# FPGA reset failed\n");
+					break;
+				}
+
+				for (uint8_t divider = FPGA_LINK_DIVIDER_SLOWEST; divider >= FPGA_LINK_DIVIDER_FASTEST; divider >>= 1)
+					dbglog("#  %2d MHz: %u bad bytes\n", 48 / divider, fpga_link_test(divider, FPGA_LINK_CONFIRM_ROUNDS));
+
+				config_t cfg;
+				config_load(&cfg);
+				cfg.spi_divider = fpga_link_train();
+				enum STATUSCODE status = config_save(&cfg);
+				dbglog("# Selected %d MHz, save status: %08X\n", 48 / cfg.spi_divider, status);
+				break;
+			}
 			case 'x':
 			{
 				SCB->VTOR = 0x8000000;
@@ -446,6 +560,8 @@ void debug_main(struct bootloader_usb *usb)
 				dbglog("   'r'  Reset timing configuration table\n");
 				dbglog("   'p'  Program eMMC with embedded payload\n");
 				dbglog("   'e'  Erase eMMC BOOT0 payload\n");
+				dbglog("   'f'  Measure FPGA SPI throughput\n");
+				dbglog("   'l'  (Re-)train FPGA SPI link\n");
 				dbglog("   'x'  Jump to bootloader\n");
 				dbglog("   'h'  Show this help text\n");
 				dbglog("# ========================\n");
@@ -22,10 +22,59 @@ void delay_init()
 	SysTick->LOAD = 0xFFFFFF;
 	SysTick->VAL = 0;
 	SysTick->CTRL = 5;
+
+	// 1 MHz, stops at the update event
+	rcu_periph_clock_enable(RCU_TIMER2);
+	timer_deinit(TIMER2);
+	timer_parameter_struct initpara;
+	initpara.prescaler = 95;
+	initpara.alignedmode = TIMER_COUNTER_EDGE;
+	initpara.counterdirection = TIMER_COUNTER_UP;
+	initpara.clockdivision = TIMER_CKDIV_DIV1;
+	initpara.repetitioncounter = 0;
+	initpara.period = 0xFFFF;
+	timer_init(TIMER2, &initpara);
+	timer_single_pulse_mode_config(TIMER2, TIMER_SP_MODE_SINGLE);
+	timer_update_source_config(TIMER2, TIMER_UPDATE_SRC_REGULAR);
+	timer_interrupt_flag_clear(TIMER2, TIMER_INT_FLAG_UP);
+	timer_interrupt_enable(TIMER2, TIMER_INT_UP);
+	nvic_irq_enable(TIMER2_IRQn, 1, 1);
+}
+
+void TIMER2_IRQHandler()
+{
+	timer_interrupt_flag_clear(TIMER2, TIMER_INT_FLAG_UP);
+}
+
+void delay_alarm(uint32_t us)
+{
+	if (us > 0xFFFF)
+		us = 0xFFFF;
+
+	timer_disable(TIMER2);
+	timer_autoreload_value_config(TIMER2, us);
+	timer_counter_value_config(TIMER2, 0);
+	timer_enable(TIMER2);
 }
 
+#if DELAY_SLEEP
+// Until the alarm or any other interrupt, whichever comes first
+static void delay_sleep(uint32_t us)
+{
+	// An alarm going off between arming and WFI still wakes us, it stays pending while masked
+	__disable_irq();
+	delay_alarm(us);
+	__WFI();
+	__enable_irq();
+}
+#endif
+
 void SysTick_delay(uint64_t val)
 {
+#if DELAY_SLEEP
+	// Only thread code with interrupts on can count on being woken
+	bool may_sleep = !__get_IPSR() && !__get_PRIMASK();
+#endif
 	uint32_t i = SysTick->VAL;
 	while (1)
 	{
@@ -35,6 +84,11 @@ void SysTick_delay(uint64_t val)
 			break;
 		val -= diff;
 		i = new_val;
+#if DELAY_SLEEP
+		// Sleeps are shorter than a SysTick wrap, so no ticks get lost
+		if (may_sleep && val >= (uint64_t)96 * DELAY_SLEEP_MIN_US)
+			delay_sleep((val - (uint64_t)96 * DELAY_SLEEP_MARGIN_US) / 96);
+#endif
 	}
 }
 
@@ -47,3 +101,27 @@ void delay_us(uint32_t nus)
 {
 	SysTick_delay((uint64_t)96 * (uint64_t)nus);
 }
+
+bool delay_until_pin(uint32_t port, uint32_t pin, int level, uint32_t timeout_us, uint32_t *waited_us)
+{
+#if DELAY_SLEEP
+	bool may_sleep = !__get_IPSR() && !__get_PRIMASK();
+#endif
+	uint64_t timeout = (uint64_t)96 * (uint64_t)timeout_us;
+	uint64_t waited = 0;
+	uint32_t i = SysTick->VAL;
+	bool ready;
+	while (!(ready = (gpio_input_bit_get(port, pin) == SET) == (level != 0)) && waited < timeout)
+	{
+		uint32_t new_val = SysTick->VAL;
+		waited += (i - new_val) & 0xFFFFFF;
+		i = new_val;
+#if DELAY_SLEEP
+		// The pin doesn't wake us, so it is looked at again after every short sleep
+		if (may_sleep && waited + (uint64_t)96 * DELAY_PIN_POLL_US <= timeout)
+			delay_sleep(DELAY_PIN_POLL_US);
+#endif
+	}
+	*waited_us = waited / 96;
+	return ready;
+}
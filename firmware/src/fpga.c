@@ -19,12 +19,47 @@
 #include <board.h>
 #include <delay.h>
 #include <statuscode.h>
+#include <profile.h>
+#include <timer.h>
 #include <string.h>
 
 int fpga_sync_failed = 1;
 
 int payload_not_yet_flashed = 1;
 
+uint32_t fpga_spi_transactions = 0;
+
+int fpga_spi_dma_enabled = 1;
+
+static uint8_t g_link_divider = FPGA_LINK_DIVIDER_DEFAULT;
+
+#define FPGA_STATUS_TIMEOUT_US 50000 // power-on until configured
+
+typedef struct
+{
+	uint8_t mask;
+	uint8_t idle; // mask bits while the event is outstanding
+	uint8_t poll_us; // pause between polls
+} fpga_event_t;
+
+static const fpga_event_t g_events[FPGA_EVENT_COUNT] =
+{
+	[FPGA_EVENT_DATA_RCVD] = {FPGA_MMC_BUSY_LOADER_DATA_RCVD, 0, 0},
+	[FPGA_EVENT_GLITCH_DONE] = {FPGA_MMC_GLITCH_SUCCESS | FPGA_MMC_GLITCH_TIMEOUT, 0, 0},
+	[FPGA_EVENT_MMC_CMD_DONE] = {FPGA_MMC_BUSY_SENDING, FPGA_MMC_BUSY_SENDING, 50},
+};
+
+#if FPGA_EVENT_IRQ
+static volatile uint32_t g_event_edges = 0; // status line edges since power-on
+static uint8_t g_event_votes = 0; // waited-for events in a row that followed an edge
+#endif
+
+#if FPGA_SPI_DMA
+static volatile int g_dma_busy = 0;
+static fpga_transfer_done_t g_dma_done = 0;
+static uint8_t g_dma_discard;
+#endif
+
 void fpga_init_spi(int prescale)
 {
 	spi_parameter_struct spi_struct;
@@ -43,7 +78,18 @@ void fpga_init_spi(int prescale)
 
 void fpga_init()
 {
+	fpga_shadow_invalidate();
 	fpga_init_spi(SPI_PSC_2);
+#if FPGA_SPI_DMA
+	nvic_irq_enable(DMA_Channel1_2_IRQn, 1, 0);
+#endif
+#if FPGA_EVENT_IRQ
+	rcu_periph_clock_enable(RCU_CFGCMP);
+	syscfg_exti_line_config(EXTI_SOURCE_GPIOA, EXTI_SOURCE_PIN1);
+	exti_init(EXTI_1, EXTI_INTERRUPT, EXTI_TRIG_BOTH);
+	exti_interrupt_flag_clear(EXTI_1);
+	nvic_irq_enable(EXTI0_1_IRQn, 1, 0);
+#endif
 	gpio_bit_reset(FPGA_PWR_EN_PORT, FPGA_PWR_EN_PIN);
 	gpio_output_options_set(FPGA_PWR_EN_PORT, GPIO_OTYPE_PP, GPIO_OSPEED_50MHZ, FPGA_PWR_EN_PIN);
 	gpio_bit_set(FPGA_CS_GPIO_PORT, FPGA_CS_GPIO_PIN);
@@ -74,26 +120,55 @@ void gpioa_set_pin4()
 
 void gpioa_clear_pin4()
 {
+#if FPGA_SPI_DMA
+	while (g_dma_busy)
+		;
+#endif
+	fpga_spi_transactions++;
 	gpio_bit_reset(FPGA_CS_GPIO_PORT, FPGA_CS_GPIO_PIN);
 }
 
+static uint32_t fpga_link_prescale(uint8_t divider)
+{
+	uint32_t psc = 0;
+	while (divider > 2)
+	{
+		divider >>= 1;
+		psc++;
+	}
+	return CTL0_PSC(psc);
+}
+
 uint32_t fpga_reset()
 {
-	fpga_init_spi(8);
+	uint32_t span = profile_begin(PROFILE_FPGA_RESET);
+	fpga_init_spi(fpga_link_prescale(g_link_divider));
+	fpga_shadow_invalidate(); // registers are lost with the power cycle
 
 	gpio_bit_reset(FPGA_PWR_EN_PORT, FPGA_PWR_EN_PIN);
 	gpioa_set_pin4();
 	delay_us(300);
 	gpio_bit_set(FPGA_PWR_EN_PORT, FPGA_PWR_EN_PIN);
-	delay_ms(50);
-	if (!gpio_input_bit_get(FPGA_STATUS_PORT, FPGA_STATUS_PIN))
-		return ERR_FPGA_STATUS_FAIL;
 
-	return OK_FPGA_RESET;
+	// The status pin is held low while the FPGA configures; the pull-up reads high before
+	// that starts. Without a low phase the whole time is waited out, as it used to be.
+	uint32_t low_us, high_us = 0;
+	bool ready = delay_until_pin(FPGA_STATUS_PORT, FPGA_STATUS_PIN, 0, FPGA_STATUS_TIMEOUT_US, &low_us);
+	if (ready)
+	{
+		uint32_t left_us = low_us < FPGA_STATUS_TIMEOUT_US ? FPGA_STATUS_TIMEOUT_US - low_us : 0;
+		ready = delay_until_pin(FPGA_STATUS_PORT, FPGA_STATUS_PIN, 1, left_us, &high_us);
+	}
+	profile_wait(PROFILE_WAIT_FPGA_STATUS, ready, low_us + high_us);
+	uint32_t result = gpio_input_bit_get(FPGA_STATUS_PORT, FPGA_STATUS_PIN) ? OK_FPGA_RESET : ERR_FPGA_STATUS_FAIL;
+	profile_end(PROFILE_FPGA_RESET, span);
+
+	return result;
 }
 
 void fpga_power_off()
 {
+	fpga_shadow_invalidate();
 	gpio_bit_reset(FPGA_PWR_EN_PORT, FPGA_PWR_EN_PIN);
 }
 
@@ -119,10 +194,84 @@ void spi0_spi_transfer_buffer(uint8_t *buf, int len)
 	while ((SPI_STAT(SPI0) & (SPI_STAT_TRANS | SPI_STAT_TBE | SPI_STAT_RBNE)) != SPI_STAT_TBE);
 }
 
+#if FPGA_SPI_DMA
+static void spi0_dma_start(uint8_t *tx, uint8_t *rx, uint32_t len, int irq)
+{
+	dma_parameter_struct dma;
+	dma.periph_addr = (uint32_t)&SPI_DATA(SPI0);
+	dma.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
+	dma.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+	dma.memory_width = DMA_MEMORY_WIDTH_8BIT;
+	dma.number = len;
+
+	// Receive into rx, or drain into a single byte when only sending. Receive has the
+	// higher priority so that no byte overruns; in-place is fine as TX always leads.
+	dma.memory_addr = rx ? (uint32_t)rx : (uint32_t)&g_dma_discard;
+	dma.memory_inc = rx ? DMA_MEMORY_INCREASE_ENABLE : DMA_MEMORY_INCREASE_DISABLE;
+	dma.direction = DMA_PERIPHERAL_TO_MEMORY;
+	dma.priority = DMA_PRIORITY_ULTRA_HIGH;
+	dma_deinit(DMA_CH1);
+	dma_init(DMA_CH1, &dma);
+
+	dma.memory_addr = (uint32_t)tx;
+	dma.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+	dma.direction = DMA_MEMORY_TO_PERIPHERAL;
+	dma.priority = DMA_PRIORITY_HIGH;
+	dma_deinit(DMA_CH2);
+	dma_init(DMA_CH2, &dma);
+
+	g_dma_busy = 1;
+	if (irq)
+		dma_interrupt_enable(DMA_CH1, DMA_INT_FTF);
+	dma_channel_enable(DMA_CH1);
+	dma_channel_enable(DMA_CH2);
+	spi_dma_enable(SPI0, SPI_DMA_RECEIVE);
+	spi_dma_enable(SPI0, SPI_DMA_TRANSMIT);
+}
+
+static void spi0_dma_stop()
+{
+	dma_interrupt_disable(DMA_CH1, DMA_INT_FTF);
+	spi_dma_disable(SPI0, SPI_DMA_TRANSMIT);
+	spi_dma_disable(SPI0, SPI_DMA_RECEIVE);
+	dma_channel_disable(DMA_CH2);
+	dma_channel_disable(DMA_CH1);
+	dma_flag_clear(DMA_CH1, DMA_FLAG_G);
+	dma_flag_clear(DMA_CH2, DMA_FLAG_G);
+}
+
+static void spi0_dma_transfer(uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+	spi0_dma_start(tx, rx, len, 0);
+	while (!dma_flag_get(DMA_CH1, DMA_FLAG_FTF))
+		;
+	spi0_dma_stop();
+	g_dma_busy = 0;
+}
+
+void DMA_Channel1_2_IRQHandler()
+{
+	if (!dma_interrupt_flag_get(DMA_CH1, DMA_INT_FLAG_FTF))
+		return;
+
+	spi0_dma_stop();
+	gpioa_set_pin4();
+	g_dma_busy = 0;
+
+	fpga_transfer_done_t done = g_dma_done;
+	g_dma_done = 0;
+	if (done)
+		done();
+}
+#endif
+
 void transfer_spi0_24_byte(uint8_t subcmd, uint8_t value)
 {
 	uint8_t buf[3];
 
+	if (!fpga_shadow_write(subcmd, value))
+		return;
+
 	buf[0] = 0x24;
 	buf[1] = subcmd;
 	buf[2] = value;
@@ -136,6 +285,9 @@ void transfer_spi0_24_word(uint8_t subcmd, uint16_t value)
 {
 	uint8_t buf[4];
 
+	if (!fpga_shadow_write(subcmd, value))
+		return;
+
 	buf[0] = 0x24;
 	buf[1] = subcmd;
 	buf[2] = value;
@@ -182,14 +334,48 @@ void fpga_reset_device(int do_clock_stuck_glitch)
 	}
 }
 
+#if FPGA_SPI_BURST
+static unsigned int fpga_burst_24_byte(uint8_t *buf, uint8_t subcmd, uint8_t value)
+{
+	if (!fpga_shadow_write(subcmd, value))
+		return 0;
+
+	buf[0] = 0x24;
+	buf[1] = subcmd;
+	buf[2] = value;
+	return 3;
+}
+#endif
+
 void fpga_glitch_device(glitch_cfg_t *cfg)
 {
+#if FPGA_SPI_BURST
+	// Stop, changed configuration and device reset in a single frame
+	uint8_t buf[3 + 4 + 3 * 3 + 3];
+	unsigned int len = fpga_burst_24_byte(buf, FPGA_REG_CONTROL, 0);
+	if (fpga_shadow_write(FPGA_REG_GLITCH_OFFSET, cfg->offset))
+	{
+		buf[len++] = 0x24;
+		buf[len++] = FPGA_REG_GLITCH_OFFSET;
+		buf[len++] = cfg->offset;
+		buf[len++] = cfg->offset >> 8;
+	}
+	len += fpga_burst_24_byte(&buf[len], FPGA_REG_GLITCH_WIDTH, cfg->width);
+	len += fpga_burst_24_byte(&buf[len], FPGA_REG_GLITCH_TIMEOUT, cfg->timeout);
+	len += fpga_burst_24_byte(&buf[len], FPGA_REG_SUBCYCLE_DELAY, cfg->subcycle_delay);
+	len += fpga_burst_24_byte(&buf[len], FPGA_REG_CONTROL, 0x80);
+
+	gpioa_clear_pin4();
+	spi0_send(buf, len);
+	gpioa_set_pin4();
+#else
 	transfer_spi0_24_6(0);
-	transfer_spi0_24_word(0x1, cfg->offset);
-	transfer_spi0_24_byte(0x2, cfg->width);
-	transfer_spi0_24_byte(0x3, cfg->timeout);
-	transfer_spi0_24_byte(0x8, cfg->subcycle_delay);
+	transfer_spi0_24_word(FPGA_REG_GLITCH_OFFSET, cfg->offset);
+	transfer_spi0_24_byte(FPGA_REG_GLITCH_WIDTH, cfg->width);
+	transfer_spi0_24_byte(FPGA_REG_GLITCH_TIMEOUT, cfg->timeout);
+	transfer_spi0_24_byte(FPGA_REG_SUBCYCLE_DELAY, cfg->subcycle_delay);
 	transfer_spi0_24_6(0x80);
+#endif
 	delay_ms(1u);
 	transfer_spi0_24_6(0x10);
 }
@@ -224,33 +410,182 @@ void fpga_do_mmc_command()
 	gpioa_set_pin4();
 }
 
-void fpga_read_buffer(uint8_t *buffer, uint32_t size)
+void fpga_read_buffer_begin()
 {
 	uint8_t cmd = 0xBA;
 	gpioa_clear_pin4();
 	spi0_send(&cmd, 1);
-	spi0_spi_transfer_buffer(buffer, size);
+}
+
+void fpga_read_buffer_next(uint8_t *buffer, uint32_t size)
+{
+#if FPGA_SPI_DMA
+	if (fpga_spi_dma_enabled && size >= FPGA_SPI_DMA_MIN_LEN)
+		spi0_dma_transfer(buffer, buffer, size);
+	else
+#endif
+		spi0_spi_transfer_buffer(buffer, size);
+}
+
+void fpga_read_buffer_end()
+{
 	gpioa_set_pin4();
 }
 
+void fpga_read_buffer(uint8_t *buffer, uint32_t size)
+{
+	fpga_read_buffer_begin();
+	fpga_read_buffer_next(buffer, size);
+	fpga_read_buffer_end();
+}
+
 void fpga_write_buffer(uint8_t *buffer, uint32_t size)
 {
 	uint8_t cmd = 0xBC;
 	gpioa_clear_pin4();
 	spi0_send(&cmd, 1);
-	spi0_send(buffer, size);
+#if FPGA_SPI_DMA
+	if (fpga_spi_dma_enabled && size >= FPGA_SPI_DMA_MIN_LEN)
+		spi0_dma_transfer(buffer, 0, size);
+	else
+#endif
+		spi0_send(buffer, size);
 	gpioa_set_pin4();
 }
 
+void fpga_read_buffer_async(uint8_t *buffer, uint32_t size, fpga_transfer_done_t done)
+{
+#if FPGA_SPI_DMA
+	if (fpga_spi_dma_enabled && size >= FPGA_SPI_DMA_MIN_LEN)
+	{
+		uint8_t cmd = 0xBA;
+		gpioa_clear_pin4();
+		spi0_send(&cmd, 1);
+		g_dma_done = done;
+		spi0_dma_start(buffer, buffer, size, 1);
+		return;
+	}
+#endif
+	fpga_read_buffer(buffer, size);
+	if (done)
+		done();
+}
+
+void fpga_write_buffer_async(uint8_t *buffer, uint32_t size, fpga_transfer_done_t done)
+{
+#if FPGA_SPI_DMA
+	if (fpga_spi_dma_enabled && size >= FPGA_SPI_DMA_MIN_LEN)
+	{
+		uint8_t cmd = 0xBC;
+		gpioa_clear_pin4();
+		spi0_send(&cmd, 1);
+		g_dma_done = done;
+		spi0_dma_start(buffer, 0, size, 1);
+		return;
+	}
+#endif
+	fpga_write_buffer(buffer, size);
+	if (done)
+		done();
+}
+
+int fpga_transfer_busy()
+{
+#if FPGA_SPI_DMA
+	return g_dma_busy;
+#else
+	return 0;
+#endif
+}
+
 void fpga_enter_cmd_mode()
 {
 	transfer_spi0_24_6(4);
 	transfer_spi0_24_6(1);
 }
 
+#if FPGA_EVENT_IRQ
+void EXTI0_1_IRQHandler()
+{
+	if (exti_interrupt_flag_get(EXTI_1) != RESET)
+	{
+		exti_interrupt_flag_clear(EXTI_1);
+		g_event_edges++;
+	}
+}
+
+// Until the next edge, at most us. The alarm bounds the sleep by itself: a missed edge or
+// the timeout must not depend on some other interrupt coming along.
+static void fpga_event_sleep(uint32_t edges, uint32_t us)
+{
+	// An edge between the check and WFI still wakes us, it stays pending while masked
+	__disable_irq();
+	if (g_event_edges == edges)
+	{
+		delay_alarm(us);
+		__WFI();
+	}
+	__enable_irq();
+}
+#endif
+
+unsigned int fpga_wait_event(enum FPGA_EVENT event, uint32_t timeout_us, uint8_t *flags)
+{
+	const fpga_event_t *ev = &g_events[event];
+	uint32_t start_us = timer_global_get_us();
+	unsigned int reads = 0;
+#if FPGA_EVENT_IRQ
+	// Edge count sampled before the last read that found the event idle: an edge after
+	// that is one the read may have missed
+	uint32_t edges = g_event_edges;
+#endif
+
+	while (1)
+	{
+#if FPGA_EVENT_IRQ
+		uint32_t sampled = g_event_edges;
+#endif
+		if (((*flags = fpga_read_mmc_flags()) & ev->mask) != ev->idle)
+			break;
+#if FPGA_EVENT_IRQ
+		edges = sampled;
+#endif
+		uint32_t spent_us = timer_global_get_us() - start_us;
+		if (timeout_us && spent_us >= timeout_us)
+			return reads;
+		reads++;
+
+#if FPGA_EVENT_IRQ
+		if (g_event_votes >= FPGA_EVENT_VOTES)
+		{
+			uint32_t sleep_us = ev->poll_us ? ev->poll_us : FPGA_EVENT_SLEEP_MAX_US;
+			if (timeout_us && timeout_us - spent_us < sleep_us)
+				sleep_us = timeout_us - spent_us;
+			fpga_event_sleep(edges, sleep_us);
+			continue;
+		}
+#endif
+		if (ev->poll_us)
+			delay_us(ev->poll_us);
+	}
+
+#if FPGA_EVENT_IRQ
+	// Only an event that had to be waited for tells whether the line announces it
+	if (reads && g_event_edges != edges)
+	{
+		if (g_event_votes < 0xFF)
+			g_event_votes++;
+	}
+	else if (reads)
+		g_event_votes = 0;
+#endif
+	return reads;
+}
+
 void fpga_pre_recv()
 {
-	while (!(fpga_read_mmc_flags() & FPGA_MMC_BUSY_LOADER_DATA_RCVD));
+	uint8_t flags;
+	fpga_wait_event(FPGA_EVENT_DATA_RCVD, 0, &flags);
 }
 
 void fpga_post_recv()
@@ -261,4 +596,94 @@ void fpga_post_recv()
 void fpga_post_send()
 {
 	transfer_spi0_24_6(3);
-}
\ No newline at end of file
+}
+static void fpga_link_pattern(uint8_t *buf, unsigned int pattern, unsigned int round)
+{
+	uint32_t lfsr = 0x2545F491 ^ round;
+	for (unsigned int i = 0; i < FPGA_LINK_TEST_SIZE; i++)
+	{
+		switch (pattern)
+		{
+			case 0: // every other bit toggles
+				buf[i] = (i & 1) ? 0xAA : 0x55;
+				break;
+			case 1: // all bits toggle at once
+				buf[i] = (i & 1) ? 0xFF : 0x00;
+				break;
+			case 2: // walking counter
+				buf[i] = i + round;
+				break;
+			default:
+				lfsr ^= lfsr << 13;
+				lfsr ^= lfsr >> 17;
+				lfsr ^= lfsr << 5;
+				buf[i] = lfsr;
+				break;
+		}
+	}
+}
+
+void fpga_link_set(uint8_t divider)
+{
+	g_link_divider = divider;
+	fpga_init_spi(fpga_link_prescale(divider));
+}
+
+uint8_t fpga_link_get()
+{
+	return g_link_divider;
+}
+
+unsigned int fpga_link_test(uint8_t divider, unsigned int rounds)
+{
+	uint8_t pattern[FPGA_LINK_TEST_SIZE];
+	uint8_t readback[FPGA_LINK_TEST_SIZE];
+	unsigned int errors = 0;
+
+	// The ID read at the current, known good clock is the reference
+	uint32_t type = fpga_read_type();
+	fpga_init_spi(fpga_link_prescale(divider));
+
+	for (unsigned int round = 0; round < rounds; round++)
+	{
+		if (fpga_read_type() != type)
+			errors++;
+
+		for (unsigned int p = 0; p < FPGA_LINK_PATTERNS; p++)
+		{
+			fpga_link_pattern(pattern, p, round);
+			fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
+			fpga_write_buffer(pattern, sizeof(pattern));
+			memset(readback, 0, sizeof(readback));
+			fpga_read_buffer(readback, sizeof(readback));
+			for (unsigned int i = 0; i < sizeof(readback); i++)
+				errors += readback[i] != pattern[i];
+		}
+	}
+
+	fpga_init_spi(fpga_link_prescale(g_link_divider));
+	return errors;
+}
+
+uint8_t fpga_link_train()
+{
+	// Walk from the slowest clock up and stop at the first one with errors. If even the
+	// slowest fails, the FPGA can't round trip its buffer and the test says nothing.
+	uint8_t best = 0;
+	for (uint8_t divider = FPGA_LINK_DIVIDER_SLOWEST; divider >= FPGA_LINK_DIVIDER_FASTEST; divider >>= 1)
+	{
+		if (fpga_link_test(divider, 1))
+			break;
+		best = divider;
+	}
+
+	// Margin: the pick has to survive a longer run, else back off one step. A link that only
+	// passes below the default keeps the slower clock; the default just failed on it.
+	if (best && best < FPGA_LINK_DIVIDER_DEFAULT && fpga_link_test(best, FPGA_LINK_CONFIRM_ROUNDS))
+		best <<= 1;
+	if (!best)
+		best = FPGA_LINK_DIVIDER_DEFAULT;
+
+	fpga_link_set(best);
+	return best;
+}
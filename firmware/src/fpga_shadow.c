@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fpga.h>
+
+#define FPGA_SHADOW_REG_COUNT (FPGA_REG_SUBCYCLE_DELAY + 1)
+
+#if FPGA_REG_SHADOW
+static uint16_t g_shadow[FPGA_SHADOW_REG_COUNT];
+#endif
+static uint16_t g_shadow_valid; // bit per register
+
+int fpga_shadow_write(uint8_t reg, uint16_t value)
+{
+#if FPGA_REG_SHADOW
+	if (reg >= FPGA_SHADOW_REG_COUNT || reg == FPGA_REG_CONTROL)
+		return 1;
+
+	if ((g_shadow_valid & (1u << reg)) && g_shadow[reg] == value)
+		return 0;
+
+	g_shadow[reg] = value;
+	g_shadow_valid |= 1u << reg;
+#endif
+	return 1;
+}
+
+void fpga_shadow_invalidate()
+{
+	g_shadow_valid = 0;
+}
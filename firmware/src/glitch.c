@@ -23,48 +23,141 @@
 #include <device.h>
 #include <fpga.h>
 #include <glitch.h>
+#include <glitch_bandit.h>
 #include <glitch_heuristic.h>
+#include <glitch_timeout.h>
 #include <leds.h>
 #include <mmc_sniffer.h>
 #include <payload.h>
+#include <profile.h>
 #include <sdio.h>
 #include <string.h>
 #include <timer.h>
 
 #define ASSERTZERO(cond) { int __test; do { __test = cond; if (__test) return __test; } while (0); }
-#define MAX_GLITCH_WIDTH 85
-#define MIN_GLITCH_WIDTH 15
-#define START_GLITCH_WIDTH ((MAX_GLITCH_WIDTH + MIN_GLITCH_WIDTH) / 2)
+
+// Stored timings that failed this many sessions in a row are skipped, except on every
+// GLITCH_REUSE_REPROBE_INTERVAL-th session so that they can recover.
+#define GLITCH_REUSE_MAX_FAIL_STREAK 3
+#define GLITCH_REUSE_REPROBE_INTERVAL 8
+// A stored timing's score is halved for every this many sessions since its last success, so
+// that a timing the console drifted away from yields to one that works now
+#define GLITCH_REUSE_STALE_SESSIONS 32
+
+// BOOT0 is rewritten once this many captures showed the boot ROM reading the payload
+// without it taking over. A search that goes this many attempts without such evidence has
+// a few blocks read back instead, in case the captures miss what went wrong.
+#define GLITCH_REFLASH_EVIDENCE 2
+#define GLITCH_REFLASH_VERIFY_INTERVAL 400
 
 enum STATUSCODE glitch_prepare(logger *lgr, session_info_t *session_info, unsigned int *adc_goal);
-enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info, unsigned int adc_goal);
-enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_info, unsigned int adc_goal);
+enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info, config_t *cfg, unsigned int adc_goal);
+enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_info, config_t *cfg, unsigned int adc_goal);
+void glitch_stage_success(logger *lgr, session_info_t *session_info, config_t *cfg);
 
 enum GLITCH_RESULT_TYPE glitch_attempt(logger *lgr, session_info_t *session_info, glitch_cfg_t *glitch_cfg);
-enum STATUSCODE flash_payload_and_update_config(logger *lgr, session_info_t *session_info);
+enum STATUSCODE flash_payload_and_update_config(logger *lgr, session_info_t *session_info, config_t *cfg, bool trust_stamp);
+
+// Length of the eMMC traffic captured during the last attempt, from the capture header
+static unsigned int read_glitch_capture_length(uint8_t mmc_flags)
+{
+	if (!(mmc_flags & FPGA_MMC_GLITCH_DT_CAPTURED))
+		return 0;
 
-int read_glitch_result(uint8_t *buf)
+	uint8_t header[FPGA_CAPTURE_LEN_OFFSET + 1];
+	fpga_select_active_buffer(FPGA_BUFFER_CMD);
+	fpga_read_buffer(header, sizeof(header));
+	return header[FPGA_CAPTURE_LEN_OFFSET];
+}
+
+static void read_glitch_capture(uint8_t *buf, unsigned int *fetched, unsigned int upto)
 {
-	if (fpga_read_mmc_flags() & FPGA_MMC_GLITCH_DT_CAPTURED)
+	if (upto > *fetched)
 	{
-		fpga_select_active_buffer(FPGA_BUFFER_CMD);
-		fpga_read_buffer(buf, 512);
-		int datalen = buf[0x10];
+		fpga_read_buffer_next(buf + *fetched, upto - *fetched);
+		*fetched = upto;
+	}
+}
+
+static bool g_payload_flash_attempted = false;
+
+// Boot progress depth of the last attempt, see GLITCH_DEPTH_MAX
+static uint8_t g_attempt_depth;
+// Attempts since the last success that point at a broken payload in BOOT0
+static uint8_t g_reflash_evidence;
+
+static uint8_t glitch_capture_depth(const mmc_sniff_t *sniff, enum GLITCH_RESULT_TYPE result)
+{
+	if (sniff->seen & MMC_SNIFF_SEEN_PAYLOAD_READ)
+		return GLITCH_DEPTH_MAX;
+	if (result == GLITCH_RESULT_FAIL_NO_EMMC_COMMS)
+		return 0;
+	if (result == GLITCH_RESULT_FAIL_TIMEOUT)
+		return 1;
+	return 2 + (sniff->block_reads < GLITCH_DEPTH_MAX_READS ? sniff->block_reads : GLITCH_DEPTH_MAX_READS);
+}
+
+// Whether the decoded frames already decide both the outcome and its depth
+static bool glitch_capture_decided(const mmc_sniff_t *sniff)
+{
+#if GLITCH_DEPTH_SEARCH
+	return (sniff->seen & MMC_SNIFF_SEEN_PAYLOAD_READ) || sniff->block_reads >= GLITCH_DEPTH_MAX_READS;
+#else
+	return sniff->seen & (MMC_SNIFF_SEEN_RESET | MMC_SNIFF_SEEN_BLOCK_READ);
+#endif
+}
 
-		fpga_select_active_buffer(FPGA_BUFFER_RESP_DATA);
-		fpga_read_buffer(buf, 512);
-		return datalen;
+// Categorize a failed attempt by its captured eMMC traffic. Frames are read from the FPGA
+// as the decoder gets to them, and only until they decide the outcome and its depth, unless
+// the logger wants to see all of it. datalen is updated to the bytes read into buf.
+static enum GLITCH_RESULT_TYPE classify_glitch_capture(logger *lgr, uint8_t *buf, unsigned int *datalen)
+{
+	unsigned int total = *datalen, fetched = 0;
+	enum GLITCH_RESULT_TYPE glitch_res = (total >= 5) ? GLITCH_RESULT_FAIL_TIMEOUT : GLITCH_RESULT_FAIL_NO_EMMC_COMMS;
+
+	fpga_select_active_buffer(FPGA_BUFFER_RESP_DATA);
+	fpga_read_buffer_begin();
+	if (lgr->full_capture)
+		read_glitch_capture(buf, &fetched, total);
+
+	mmc_sniff_t sniff;
+	mmc_sniff_init(&sniff);
+	unsigned int pos = 0;
+	while (!glitch_capture_decided(&sniff) && pos + MMC_SNIFF_FRAME_LEN <= total)
+	{
+		read_glitch_capture(buf, &fetched, pos + MMC_SNIFF_FRAME_LEN);
+		unsigned int len = mmc_sniff_frame_length(&sniff, buf + pos);
+		if (pos + len > total)
+			break;
+		read_glitch_capture(buf, &fetched, pos + len);
+		pos += mmc_sniff_frame(&sniff, buf + pos);
 	}
-	return 0;
+	fpga_read_buffer_end();
+
+	// The boot ROM is still alive if it reset the eMMC or went on reading blocks
+	if (sniff.seen & (MMC_SNIFF_SEEN_RESET | MMC_SNIFF_SEEN_BLOCK_READ))
+		glitch_res = GLITCH_RESULT_FAILED_MMC;
+
+	// It only reads the payload sectors once it took the BCT, so the payload didn't take over
+	if ((sniff.seen & MMC_SNIFF_SEEN_PAYLOAD_READ) && g_reflash_evidence < 0xFF)
+		g_reflash_evidence++;
+
+	g_attempt_depth = glitch_capture_depth(&sniff, glitch_res);
+	*datalen = fetched;
+	return glitch_res;
 }
 
 enum STATUSCODE glitch(logger *lgr, session_info_t *session_info, bool is_training)
 {
 	lgr->start();
 	leds_set_pattern_delayed(is_training ? &lp_train_prepare : &lp_glitch_prepare, 300);
+
+	// Persist what the previous session learned before the console is powered up
+	config_commit();
 	timer2_init();
 
 	enum STATUSCODE result;
+	config_t cfg; // kept for the whole session, saved on success
 	for (;;)
 	{
 		unsigned int adc_goal;
@@ -75,20 +168,30 @@ enum STATUSCODE glitch(logger *lgr, session_info_t *session_info, bool is_traini
 		session_info->power_threshold_reached_us = timer2_get_total();
 
 		// Check if payload must be flashed
-		config_t cfg;
 		bool flash_payload = config_load(&cfg) != OK_CONFIG || cfg.reflash;
 		if (flash_payload)
 		{
-			result = flash_payload_and_update_config(lgr, session_info);
+			// A missing config alone doesn't mean BOOT0 changed; the reflash flag does
+			result = flash_payload_and_update_config(lgr, session_info, &cfg, !cfg.reflash);
 			if (result != OK_FLASH_SUCCESS)
 				break;
 		}
 
 		lgr->glitching_started();
 		leds_set_pattern(is_training ? &lp_train_glitching : &lp_glitch_glitching);
-		result = glitch_reuse_offsets(lgr, session_info, adc_goal);
+		uint32_t span = profile_begin(PROFILE_GLITCH);
+		result = glitch_reuse_offsets(lgr, session_info, &cfg, adc_goal);
 		if (result != OK_GLITCH_SUCCESS)
-			result = glitch_search_new_offset(lgr, session_info, adc_goal);
+			result = glitch_search_new_offset(lgr, session_info, &cfg, adc_goal);
+		profile_end(PROFILE_GLITCH, span);
+
+		// Every session that glitched counts, so that the reprobe comes around during a run
+		// of failing ones too, and their fail streaks and attempts are kept
+		cfg.boot_count++;
+		if (result == OK_GLITCH_SUCCESS)
+			glitch_stage_success(lgr, session_info, &cfg);
+		else
+			config_stage(&cfg);
 
 		break;
 	}
@@ -121,9 +224,11 @@ enum STATUSCODE glitch(logger *lgr, session_info_t *session_info, bool is_traini
 
 enum STATUSCODE glitch_prepare(logger *lgr, session_info_t *session_info, unsigned int *adc_goal)
 {
+	uint32_t span = profile_begin(PROFILE_DEVICE_DETECT);
 	session_info->device_type = detect_device_type();
 	session_info->board_id = board_id_get();
 	session_info->fpga_type = fpga_read_type();
+	profile_end(PROFILE_DEVICE_DETECT, span);
 
 	lgr->device_type(session_info->device_type);
 	struct adc_param adc_min_values = {0};
@@ -136,7 +241,9 @@ enum STATUSCODE glitch_prepare(logger *lgr, session_info_t *session_info, unsign
 	do
 	{
 		uint16_t adc_read;
+		span = profile_begin(PROFILE_ADC_WAIT);
 		ret = adc_wait_for_min_value(lgr, adc_min_values.glitch_threshold, &adc_read);
+		profile_end(PROFILE_ADC_WAIT, span);
 
 		if (adc_read >= adc_min_values.glitch_threshold)
 		{
@@ -150,29 +257,95 @@ enum STATUSCODE glitch_prepare(logger *lgr, session_info_t *session_info, unsign
 		}
 
 		// Reset to retry. Perform longer reset every 2nd try.
+		span = profile_begin(PROFILE_DEVICE_RESET);
 		fpga_reset_device(session_info->was_the_device_reset & 1);
+		profile_end(PROFILE_DEVICE_RESET, span);
 		session_info->was_the_device_reset++;
 	} while (!ret || session_info->was_the_device_reset < 5);
 
 	return ret;
 }
 
-enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info, unsigned int adc_goal)
+static uint32_t glitch_reuse_score(const config_t *cfg, const timing_t *timing)
+{
+	unsigned int stale = (uint16_t)(cfg->boot_count - timing->last_success_boot) / GLITCH_REUSE_STALE_SESSIONS;
+	return stale > 16 ? 0 : config_timing_score(timing) >> stale;
+}
+
+static unsigned int glitch_reuse_order(const config_t *cfg, uint8_t *order)
+{
+	bool reprobe = (cfg->boot_count % GLITCH_REUSE_REPROBE_INTERVAL) == 0;
+	unsigned int count = 0;
+	for (int i = 0; i < cfg->count; i++)
+	{
+		if (reprobe || cfg->timings[i].fail_streak < GLITCH_REUSE_MAX_FAIL_STREAK)
+			order[count++] = i;
+	}
+
+	// Most likely to succeed per attempt first, as far as recent sessions tell; ties by
+	// lifetime successes
+	for (unsigned int i = 1; i < count; i++)
+	{
+		uint8_t idx = order[i];
+		uint32_t score = glitch_reuse_score(cfg, &cfg->timings[idx]);
+		unsigned int j = i;
+		for (; j > 0; j--)
+		{
+			const timing_t *prev = &cfg->timings[order[j - 1]];
+			uint32_t prev_score = glitch_reuse_score(cfg, prev);
+			if (prev_score > score || (prev_score == score && prev->success >= cfg->timings[idx].success))
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = idx;
+	}
+
+	return count;
+}
+
+// Subcycle delays to rotate through for a stored timing: the ones it succeeded with, most
+// successful first, or all of them when all is set or it has no such history.
+static unsigned int glitch_subcycle_order(const timing_t *timing, bool all, uint8_t *order)
+{
+	unsigned int count = 0;
+	order[count++] = timing->subcycle_delay & 3;
+	for (unsigned int k = 0; k < 4; k++)
+	{
+		if (k != order[0] && (all || timing->subcycle_hits[k]))
+			order[count++] = k;
+	}
+
+	for (unsigned int i = 2; i < count; i++)
+	{
+		uint8_t k = order[i];
+		unsigned int j = i;
+		for (; j > 1 && timing->subcycle_hits[order[j - 1]] < timing->subcycle_hits[k]; j--)
+			order[j] = order[j - 1];
+		order[j] = k;
+	}
+
+	return count;
+}
+
+enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info, config_t *cfg, unsigned int adc_goal)
 {
-	config_t cfg;
-	config_load(&cfg);
 	bool fatal_abort = false;
 	session_info->glitch_attempt = 0;
+	session_info->first_timing_success = 0;
+
+	uint8_t order[CONFIG_MAX_TIMINGS];
+	unsigned int order_count = glitch_reuse_order(cfg, order);
 
 	// Loop through known glitch configs that worked in the past
-	for (int i = 0; i < cfg.count && !fatal_abort; ++i)
+	for (int i = 0; i < order_count && !fatal_abort; ++i)
 	{
 		// Load stored config
+		timing_t *timing = &cfg->timings[order[i]];
 		glitch_cfg_t glitch_cfg;
-		glitch_cfg.offset = cfg.timings[i].offset;
-		glitch_cfg.width = cfg.timings[i].width;
-		glitch_cfg.subcycle_delay = 0;
-		glitch_cfg.timeout = 50;
+		glitch_cfg.offset = timing->offset;
+		glitch_cfg.width = timing->width;
+		glitch_cfg.timeout = timing->timeout ? timing->timeout : CONFIG_DEFAULT_TIMEOUT;
+		unsigned int first_attempt = session_info->glitch_attempt;
 
 		// Allow each config to be rejected by the heuristic 3x before moving on
 		const unsigned int retries_per_config = 3;
@@ -182,6 +355,12 @@ enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info,
 			// and when to move on to next offset.
 			glitch_heuristic_t heuristic = {0};
 			bool next_offset = false;
+
+			// Stick to the subcycle delays that worked before in the first round
+			uint8_t subcycles[4];
+			unsigned int subcycle_count = glitch_subcycle_order(timing, j > 0, subcycles);
+			unsigned int subcycle_idx = 0;
+			glitch_cfg.subcycle_delay = subcycles[0];
 			do
 			{
 				// Wait until device is ready to be glitched, reset if necessary.
@@ -193,8 +372,17 @@ enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info,
 
 				// Perform glitch attempt and add result to heuristic
 				enum GLITCH_RESULT_TYPE res = glitch_attempt(lgr, session_info, &glitch_cfg);
+#if GLITCH_SEARCH_BANDIT
+				bandit_add_result(&glitch_cfg, res, g_attempt_depth);
+#endif
 				if (res == GLITCH_RESULT_SUCCESS)
+				{
+					// The successful attempt itself is accounted by glitch_stage_success()
+					unsigned int failed = session_info->glitch_attempt - first_attempt - 1;
+					config_timing_add_attempts(timing, failed, failed);
+					session_info->first_timing_success = i == 0;
 					return OK_GLITCH_SUCCESS;
+				}
 
 				heuristic_add_result(&heuristic, res);
 
@@ -203,16 +391,140 @@ enum STATUSCODE glitch_reuse_offsets(logger *lgr, session_info_t *session_info,
 				heuristic_advice(&heuristic, &fatal_abort, &next_offset, &width_adjust, &offset_adjust);
 				glitch_cfg.width += width_adjust;
 				glitch_cfg.offset += offset_adjust;
-				glitch_cfg.subcycle_delay = (glitch_cfg.subcycle_delay + 1) & 3;
+				subcycle_idx = (subcycle_idx + 1) % subcycle_count;
+				glitch_cfg.subcycle_delay = subcycles[subcycle_idx];
 			} while (!fatal_abort && !next_offset);
 		}
+
+		unsigned int failed = session_info->glitch_attempt - first_attempt;
+		config_timing_add_attempts(timing, failed, failed);
+		if (timing->fail_streak < 0xFF)
+			timing->fail_streak++;
 	}
 
 	// Exhausted options
 	return ERR_GLITCH_TOO_MANY_ATTEMPTS;
 }
 
-enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_info, unsigned int adc_goal)
+static void glitch_train_note_first(glitch_train_t *train)
+{
+	const config_t *cfg = config_get();
+	uint8_t order[CONFIG_MAX_TIMINGS];
+	uint16_t offset = 0xFFFF;
+	uint8_t width = 0;
+	if (glitch_reuse_order(cfg, order))
+	{
+		offset = cfg->timings[order[0]].offset;
+		width = cfg->timings[order[0]].width;
+	}
+
+	if (offset != train->first_offset || width != train->first_width)
+	{
+		train->first_offset = offset;
+		train->first_width = width;
+		train->sessions = 0;
+		train->hits = 0;
+	}
+}
+
+void glitch_train_init(glitch_train_t *train)
+{
+	memset(train, 0, sizeof(glitch_train_t));
+	train->first_offset = 0xFFFF;
+	glitch_train_note_first(train);
+}
+
+// Whether the lower Wilson bound of hits out of sessions reaches GLITCH_TRAIN_TARGET. That is
+// the case when the target lies below the observed rate and outside the score interval:
+// (hits - sessions * t)^2 >= z^2 * sessions * t * (1 - t), here scaled to integers.
+static bool glitch_train_confident(unsigned int hits, unsigned int sessions)
+{
+	int64_t excess = (int64_t)hits * 100 - (int64_t)sessions * GLITCH_TRAIN_TARGET;
+	if (excess <= 0)
+		return false;
+	uint64_t lhs = (uint64_t)(excess * excess) * 100 * 100;
+	uint64_t rhs = (uint64_t)GLITCH_TRAIN_Z100 * GLITCH_TRAIN_Z100 * sessions * GLITCH_TRAIN_TARGET * (100 - GLITCH_TRAIN_TARGET);
+	return lhs >= rhs;
+}
+
+bool glitch_train_add(glitch_train_t *train, enum STATUSCODE status, const session_info_t *session_info)
+{
+	// The session started with the table as it was noted last time
+	if (train->sessions < 0xFFFF)
+	{
+		train->sessions++;
+		if (status == OK_GLITCH_SUCCESS && session_info->first_timing_success)
+			train->hits++;
+	}
+	if (status == OK_GLITCH_SUCCESS && train->successes < 0xFFFF)
+		train->successes++;
+
+	bool done = train->successes >= GLITCH_TRAIN_MAX_SUCCESSES ||
+		(train->successes >= GLITCH_TRAIN_MIN_SUCCESSES && glitch_train_confident(train->hits, train->sessions));
+	glitch_train_note_first(train);
+	return done;
+}
+
+static bool g_payload_verify_attempted = false;
+// Look after BOOT0 before the next attempt of a search, if the attempts so far call for it
+static enum STATUSCODE glitch_check_payload(logger *lgr, session_info_t *session_info, config_t *cfg)
+{
+	if (g_reflash_evidence >= GLITCH_REFLASH_EVIDENCE)
+	{
+		g_reflash_evidence = 0;
+		return flash_payload_and_update_config(lgr, session_info, cfg, false);
+	}
+
+	if (session_info->glitch_attempt == 0 || (session_info->glitch_attempt % GLITCH_REFLASH_VERIFY_INTERVAL) != 0)
+		return OK_FLASH_SUCCESS;
+
+	// Like reflashing, once per session
+	if (g_payload_verify_attempted || g_payload_flash_attempted)
+		return OK_FLASH_SUCCESS;
+	g_payload_verify_attempted = true;
+
+	led_pattern_t prev = leds_get_pattern();
+	uint8_t cid[16];
+	uint32_t start_us = profile_begin(PROFILE_PAYLOAD_VERIFY);
+	enum STATUSCODE result = verify_payload(cid, session_info->device_type);
+	profile_end(PROFILE_PAYLOAD_VERIFY, start_us);
+	session_info->payload_program_us = timer_get_global_total() - start_us;
+	session_info->mmc_bringup = g_mmc_bringup;
+	lgr->payload_flash_res_and_cid(result, cid);
+
+	leds_set_pattern(&prev);
+	return result;
+}
+
+#if !GLITCH_SEARCH_BANDIT && GLITCH_DEPTH_SEARCH
+// The offsets tried so far are the range [lo, hi] around the centre of the table. It grows on
+// the side whose edge got the boot ROM further on average; once it spans the whole table, it
+// starts over from the offset that did best.
+static unsigned int glitch_depth_next_offset(const uint16_t *depth_sums, const uint16_t *depth_counts, unsigned int count, unsigned int *lo, unsigned int *hi)
+{
+	if (*lo == 0 && *hi == count - 1)
+	{
+		unsigned int best = 0;
+		for (unsigned int i = 1; i < count; i++)
+		{
+			if ((uint32_t)depth_sums[i] * depth_counts[best] > (uint32_t)depth_sums[best] * depth_counts[i])
+				best = i;
+		}
+		*lo = *hi = best;
+		return best;
+	}
+
+	if (*lo == 0)
+		return ++*hi;
+	if (*hi == count - 1)
+		return --*lo;
+	if ((uint32_t)depth_sums[*lo] * depth_counts[*hi] > (uint32_t)depth_sums[*hi] * depth_counts[*lo])
+		return --*lo;
+	return ++*hi;
+}
+#endif
+
+enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_info, config_t *cfg, unsigned int adc_goal)
 {
 	const uint16_t erista_offsets[] = {825, 830, 835, 840, 845, 850, 855, 860, 865, 870, 875, 880, 885, 890, 895, 900, 905};
 	const uint16_t mariko_offsets[] = {800, 805, 810, 815, 820, 825, 830, 835, 840, 845, 850, 855, 860, 865, 870, 875, 880};
@@ -230,14 +542,55 @@ enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_in
 		offsets_count = sizeof(mariko_offsets) / sizeof(mariko_offsets[0]);
 	}
 
-	int offset_idx = offsets_count / 2; // Start in the center of window; this helps converging to good pulse width quickly.
+#if GLITCH_SEARCH_BANDIT
+	(void)offsets_count; // the bandit grid spans BANDIT_OFFSET_BINS offsets from the start of the window
+	glitch_cfg_t glitch_cfg;
+	glitch_cfg.timeout = CONFIG_DEFAULT_TIMEOUT;
+	bandit_init(offsets[0], timer_get_global_total() ^ ((uint32_t)adc_wait_eoc_read() << 16));
+
+	const unsigned int max_glitch_attempts = 1200;
+	const unsigned int max_no_comms_in_row = 8;
+	unsigned int no_comms_in_row = 0;
+	for (session_info->glitch_attempt = 0; session_info->glitch_attempt <= max_glitch_attempts; )
+	{
+		enum STATUSCODE flash_result = glitch_check_payload(lgr, session_info, cfg);
+		if (flash_result != OK_FLASH_SUCCESS)
+			return flash_result;
+
+		// Wait until device is ready to be glitched, reset if necessary.
+		if (adc_wait_eoc_read() < adc_goal)
+		{
+			ASSERTZERO(adc_wait_for_min_value(lgr, session_info->device_type == DEVICE_TYPE_LITE ? adc_goal : adc_goal - 100, 0));
+			session_info->adc_goal_reached_us = timer2_get_total();
+		}
+
+		// Sample the next cell to try from the posterior and learn from the outcome
+		bandit_next(&glitch_cfg);
+		enum GLITCH_RESULT_TYPE res = glitch_attempt(lgr, session_info, &glitch_cfg);
+		bandit_add_result(&glitch_cfg, res, g_attempt_depth);
+		if (res == GLITCH_RESULT_SUCCESS)
+			return OK_GLITCH_SUCCESS;
+
+		// Same abort condition as the heuristic: eMMC bus stays silent
+		no_comms_in_row = res == GLITCH_RESULT_FAIL_NO_EMMC_COMMS ? no_comms_in_row + 1 : 0;
+		if (no_comms_in_row >= max_no_comms_in_row)
+			break;
+	}
+
+	return ERR_GLITCH_TOO_MANY_ATTEMPTS;
+#else
+	unsigned int offset_idx = offsets_count / 2; // Start in the center of window; this helps converging to good pulse width quickly.
+#if GLITCH_DEPTH_SEARCH
+	uint16_t depth_sums[sizeof(erista_offsets) / sizeof(erista_offsets[0])] = {0};
+	uint16_t depth_counts[sizeof(erista_offsets) / sizeof(erista_offsets[0])] = {0};
+	unsigned int depth_lo = offset_idx, depth_hi = offset_idx;
+#endif
 	glitch_cfg_t glitch_cfg;
 	glitch_cfg.width = START_GLITCH_WIDTH;
 	glitch_cfg.subcycle_delay = 0;
-	glitch_cfg.timeout = 50;
+	glitch_cfg.timeout = CONFIG_DEFAULT_TIMEOUT;
 
 	bool fatal_abort = false;
-	bool reflash = false;
 
 	const unsigned int max_glitch_attempts = 1200;
 	for (session_info->glitch_attempt = 0; !fatal_abort && session_info->glitch_attempt <= max_glitch_attempts; )
@@ -250,15 +603,9 @@ enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_in
 		bool next_offset = false;
 		do
 		{
-			// Poor heuristic to determine whether to reflash payload to BOOT0..
-			reflash |= (session_info->glitch_attempt % 400) == 0;
-			if (reflash)
-			{
-				reflash = false;
-				enum STATUSCODE flash_result = flash_payload_and_update_config(lgr, session_info);
-				if (flash_result != OK_FLASH_SUCCESS)
-					return flash_result;
-			}
+			enum STATUSCODE flash_result = glitch_check_payload(lgr, session_info, cfg);
+			if (flash_result != OK_FLASH_SUCCESS)
+				return flash_result;
 
 			// Wait until device is ready to be glitched, reset if necessary.
 			if (adc_wait_eoc_read() < adc_goal)
@@ -272,6 +619,15 @@ enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_in
 			if (res == GLITCH_RESULT_SUCCESS)
 				return OK_GLITCH_SUCCESS;
 
+#if GLITCH_DEPTH_SEARCH
+			// Whether a pulse hangs the CPU depends on the width, which the heuristic is still moving;
+			// only compare how far the boot ROM got when it survived. No overflow within max_glitch_attempts.
+			if (res == GLITCH_RESULT_FAILED_MMC)
+			{
+				depth_sums[offset_idx] += g_attempt_depth;
+				depth_counts[offset_idx]++;
+			}
+#endif
 			heuristic_add_result(&heuristic, res);
 
 			// Query heuristic for advice on how to continue
@@ -283,18 +639,22 @@ enum STATUSCODE glitch_search_new_offset(logger *lgr, session_info_t *session_in
 
 			if (glitch_cfg.width > MAX_GLITCH_WIDTH || glitch_cfg.width < MIN_GLITCH_WIDTH)
 			{
-				// Reflash & recenter width
-				reflash = true;
+				// Recenter width
 				glitch_cfg.width = START_GLITCH_WIDTH;
 				break;
 			}
 		} while (!fatal_abort && !next_offset && session_info->glitch_attempt < max_glitch_attempts);
 
+#if GLITCH_DEPTH_SEARCH
+		offset_idx = glitch_depth_next_offset(depth_sums, depth_counts, offsets_count, &depth_lo, &depth_hi);
+#else
 		offset_idx = (offset_idx + 1) % offsets_count;
+#endif
 
 	} // for
 
 	return ERR_GLITCH_TOO_MANY_ATTEMPTS;
+#endif
 }
 
 enum GLITCH_RESULT_TYPE glitch_attempt(logger *lgr, session_info_t *session_info, glitch_cfg_t *glitch_cfg)
@@ -302,104 +662,134 @@ enum GLITCH_RESULT_TYPE glitch_attempt(logger *lgr, session_info_t *session_info
 	// Attempt single glitch attempt with given parameters
 	// and categorize outcome using eMMC bus monitoring.
 	session_info->glitch_attempt++;
+#if GLITCH_ADAPTIVE_TIMEOUT
+	// The caller's timeout stays the upper bound for every attempt
+	glitch_cfg_t attempt_cfg = *glitch_cfg;
+	attempt_cfg.timeout = glitch_timeout_next(glitch_cfg->timeout);
+	glitch_cfg = &attempt_cfg;
+#endif
 	fpga_glitch_device(glitch_cfg);
+	uint32_t armed_us = timer2_get_total();
 	uint8_t mmc_flags;
-	uint8_t glitch_flags;
-	do
-	{
-		mmc_flags = fpga_read_mmc_flags();
-		glitch_flags = fpga_read_glitch_flags();
-	} while (!(mmc_flags & (FPGA_MMC_GLITCH_SUCCESS | FPGA_MMC_GLITCH_TIMEOUT)));
+	fpga_wait_event(FPGA_EVENT_GLITCH_DONE, 0, &mmc_flags);
+	uint32_t elapsed_us = timer2_get_total() - armed_us;
+
+	// Only logged, so read once the outcome is known rather than on every poll
+	uint8_t glitch_flags = fpga_read_glitch_flags();
 
 	uint8_t data[512];
-	int datalen = read_glitch_result(data);
+	unsigned int datalen = read_glitch_capture_length(mmc_flags);
 
 	if (mmc_flags & FPGA_MMC_GLITCH_SUCCESS)
 	{
 		// Success bit set. Skip eMMC traffic analysis.
 		session_info->glitch_complete_us = timer2_get_total();
+		g_attempt_depth = GLITCH_DEPTH_MAX;
+#if GLITCH_ADAPTIVE_TIMEOUT
+		glitch_timeout_add_result(glitch_cfg->timeout, GLITCH_RESULT_SUCCESS, elapsed_us);
+		session_info->learned_timeout = glitch_timeout_learned();
+		session_info->traffic_latency_us = glitch_timeout_latency_us();
+#endif
+		// Nothing to categorize; only read for the logger
+		if (lgr->full_capture && datalen)
+		{
+			fpga_select_active_buffer(FPGA_BUFFER_RESP_DATA);
+			fpga_read_buffer(data, datalen);
+		}
+		else
+			datalen = 0;
 		lgr->glitch_result(glitch_cfg, GLITCH_RESULT_SUCCESS, mmc_flags, datalen, data, glitch_flags);
 
 		// Confirm glitch success by awaiting command over eMMC bus.
 		// This detects false-positives.
 		fpga_enter_cmd_mode();
-		unsigned int max_flag_reads = 200000; // takes about 1s
-		unsigned int flag_reads;
-		for (flag_reads = 0; flag_reads < max_flag_reads; flag_reads++)
+		uint8_t confirm_flags;
+		unsigned int flag_reads = fpga_wait_event(FPGA_EVENT_DATA_RCVD, 1000000, &confirm_flags);
+		if (confirm_flags & FPGA_MMC_BUSY_LOADER_DATA_RCVD)
 		{
-			if (fpga_read_mmc_flags() & FPGA_MMC_BUSY_LOADER_DATA_RCVD)
-			{
-				// read buffer so flags get cleared
-				fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
-				data[0] = 0;
-				fpga_read_buffer(data, 512);
-				fpga_post_recv();
-				break;
-			}
+			// read buffer so flags get cleared
+			fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
+			data[0] = 0;
+			fpga_read_buffer(data, 512);
+			fpga_post_recv();
 		}
 
 		if (flag_reads > 0)
 		{
+			g_reflash_evidence = 0;
 			session_info->glitch_confirm_us = timer2_get_total();
 			session_info->flag_reads_before_glitch_confirmed = flag_reads;
 			session_info->total_time_us = timer_get_global_total();
 			session_info->glitch_cfg = *glitch_cfg;
-
-			// Update config in flash
-			config_t cfg;
-			config_load(&cfg);
-			if (config_add_new(&cfg, glitch_cfg) == 0x900D0007)
-			{
-				lgr->new_config_and_save(glitch_cfg, config_save(&cfg));
-			}
 			return GLITCH_RESULT_SUCCESS;
 		}
 		else
 		{
 			led_pattern_t blink_yellow = {blink, 0xC0, 0xFF, 0x00};
 			leds_override(500, &blink_yellow);
+			// Not evidence against BOOT0: a false positive of the success flag looks the
+			// same as a payload that never got to the bus, and the flag fires far more often
+			g_attempt_depth = 1;
 			return GLITCH_RESULT_FAIL_TIMEOUT;
 		}
 	}
 	else
 	{
 		// Analyse eMMC bus traffic to categorize glitch attempt result
-		mmc_sniff_parser_ctx ctx;
-		mmc_sniff_parser_init(&ctx, data, datalen);
-		enum GLITCH_RESULT_TYPE glitch_res = (datalen >= 5) ? GLITCH_RESULT_FAIL_TIMEOUT : GLITCH_RESULT_FAIL_NO_EMMC_COMMS;
-		enum MMC_SNIFFER_PACKET_TYPE sniffer_result;
-		do
-		{
-			sniffer_result = mmc_sniff_parser_parse(&ctx);
-			if (sniffer_result == MMC_SNIFF_PKT_TYPE_COMMAND && (ctx.cmd == MMC_READ_SINGLE_BLOCK || ctx.cmd == MMC_GO_IDLE_STATE))
-				glitch_res = GLITCH_RESULT_FAILED_MMC;
-		} while (sniffer_result != MMC_SNIFF_PKT_TYPE_INVALID);
+		enum GLITCH_RESULT_TYPE glitch_res = classify_glitch_capture(lgr, data, &datalen);
+
+#if GLITCH_ADAPTIVE_TIMEOUT
+		glitch_timeout_add_result(glitch_cfg->timeout, glitch_res, elapsed_us);
+		session_info->learned_timeout = glitch_timeout_learned();
+		session_info->traffic_latency_us = glitch_timeout_latency_us();
+#else
+		(void)elapsed_us;
+#endif
 
 		lgr->glitch_result(glitch_cfg, glitch_res, mmc_flags, datalen, data, glitch_flags);
 		return glitch_res;
 	}
 }
 
-static bool g_payload_flash_attempted = false;
-enum STATUSCODE flash_payload_and_update_config(logger *lgr, session_info_t *session_info)
+void glitch_stage_success(logger *lgr, session_info_t *session_info, config_t *cfg)
+{
+	// Update config. Kept even if the timing could not be added, so that the statistics
+	// gathered by glitch_reuse_offsets() are kept. Only staged in RAM: the console is
+	// waiting for the eMMC now, it is written to flash once it is idle (see config_commit()).
+	glitch_cfg_t glitch_cfg = session_info->glitch_cfg;
+#if GLITCH_ADAPTIVE_TIMEOUT
+	// Store the learned window rather than that of the successful attempt, which may have been a probe
+	if (glitch_timeout_learned())
+		glitch_cfg.timeout = glitch_timeout_learned();
+#endif
+	enum STATUSCODE add_result = config_add_new(cfg, &glitch_cfg);
+	enum STATUSCODE save_result = config_stage(cfg);
+	if (add_result == OK_CONFIG)
+		lgr->new_config_and_save(&glitch_cfg, save_result);
+}
+
+enum STATUSCODE flash_payload_and_update_config(logger *lgr, session_info_t *session_info, config_t *cfg, bool trust_stamp)
 {
 	// Prevent doing this multiple times per session. Failure always indicates improper wiring.
+	// A pass that trusted the stamp doesn't count, evidence against BOOT0 may still come up.
 	if (!g_payload_flash_attempted)
 	{
-		g_payload_flash_attempted = true;
+		g_payload_flash_attempted = !trust_stamp;
 
 		// Clear flag from config if it was set
-		config_t cfg;
-		config_load(&cfg);
-		if (cfg.reflash)
+		if (cfg->reflash)
 		{
-			cfg.reflash = 0;
-			config_save(&cfg);
+			cfg->reflash = 0;
+			config_save(cfg);
 		}
 
 		led_pattern_t prev = leds_get_pattern();
 		uint8_t cid[16];
-		enum STATUSCODE result = flash_payload(cid, session_info->device_type);
+		uint32_t start_us = profile_begin(PROFILE_PAYLOAD_FLASH);
+		enum STATUSCODE result = flash_payload(cid, session_info->device_type, trust_stamp);
+		profile_end(PROFILE_PAYLOAD_FLASH, start_us);
+		session_info->payload_program_us = timer_get_global_total() - start_us;
+		session_info->mmc_bringup = g_mmc_bringup;
 		lgr->payload_flash_res_and_cid(result, cid);
 
 		if (result == OK_FLASH_SUCCESS)
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glitch_bandit.h>
+
+// All probabilities are Q16 fixed point; counts are Q8 so that fractional
+// prior pseudo-counts can be added to them.
+#define Q16_ONE 0x10000u
+#define BANDIT_PRIOR_PEAK 0x2000u    // prior success chance of a width right on the hang boundary (1/8)
+#define BANDIT_PRIOR_FLOOR 0x80u     // prior success chance far away from it; keeps the prior alpha non-zero
+#define BANDIT_PRIOR_STRENGTH 2
+#define BANDIT_DEPTH_GAIN 4          // prior scale per GLITCH_DEPTH_MAX of mean depth above the average, Q8 is 1x
+#define BANDIT_DEPTH_MIN_SAMPLES 2
+#define BANDIT_DEPTH_TILT_MIN 0x40   // Q8
+#define BANDIT_DEPTH_TILT_MAX 0x400
+
+static bandit_cell_t g_cells[BANDIT_OFFSET_BINS][BANDIT_WIDTH_BINS];
+static uint16_t g_width_timeouts[BANDIT_WIDTH_BINS];
+static uint16_t g_width_block_reads[BANDIT_WIDTH_BINS];
+static bandit_cell_t g_subcycles[4];
+static bandit_depth_t g_offset_depths[BANDIT_OFFSET_BINS];
+static uint16_t g_first_offset;
+static uint32_t g_rand;
+
+static uint32_t bandit_rand()
+{
+	// xorshift32
+	g_rand ^= g_rand << 13;
+	g_rand ^= g_rand >> 17;
+	g_rand ^= g_rand << 5;
+	return g_rand;
+}
+
+static uint32_t isqrt(uint32_t x)
+{
+	uint32_t res = 0;
+	for (uint32_t bit = 1u << 30; bit; bit >>= 2)
+	{
+		if (x >= res + bit)
+		{
+			x -= res + bit;
+			res = (res >> 1) + bit;
+		}
+		else
+			res >>= 1;
+	}
+	return res;
+}
+
+// Draw from an approximation of Beta(alpha, beta): a normal with the same
+// mean and variance, using an Irwin-Hall sum of four uniforms for the normal.
+// Cheap enough to sample every cell before each attempt without an FPU.
+static int32_t bandit_sample(uint32_t alpha_q8, uint32_t beta_q8)
+{
+	uint32_t n = alpha_q8 + beta_q8;
+	uint32_t mean = (alpha_q8 << 16) / n;
+	uint32_t var = ((mean * (Q16_ONE - mean)) / (n + 256)) << 8; // Q32
+	uint32_t sd = isqrt(var); // Q16
+
+	uint32_t r1 = bandit_rand(), r2 = bandit_rand();
+	int32_t z = (int32_t)((r1 & 0xFFFF) + (r1 >> 16) + (r2 & 0xFFFF) + (r2 >> 16)) - 2 * (int32_t)Q16_ONE;
+	z = (z * 887) >> 9; // scale to unit variance: * sqrt(3)
+
+	return (int32_t)mean + (int32_t)(((int64_t)sd * z) >> 16);
+}
+
+static uint32_t bandit_width_prior(unsigned int width_bin)
+{
+	// The sweet spot sits where pulses start to hang the CPU, i.e. where timeouts and
+	// "no effect" block reads are about equally likely. Score widths by (4 h (1 - h))^4
+	// with h the estimated hang fraction, which falls off quickly for one-sided bins
+	// but tolerates a boundary bin that leans to either side.
+	uint32_t t = g_width_timeouts[width_bin], m = g_width_block_reads[width_bin];
+	uint32_t hang = (uint32_t)(((uint64_t)(t + 1) << 16) / (t + m + 2));
+	uint32_t boundary = (uint32_t)((4 * (uint64_t)hang * (Q16_ONE - hang)) >> 16);
+	boundary = (uint32_t)(((uint64_t)boundary * boundary) >> 16);
+	boundary = (uint32_t)(((uint64_t)boundary * boundary) >> 16);
+	return BANDIT_PRIOR_FLOOR + ((BANDIT_PRIOR_PEAK * boundary) >> 16);
+}
+
+static bool bandit_cell_index(const glitch_cfg_t *cfg, unsigned int *offset_bin, unsigned int *width_bin)
+{
+	int offset = (int)cfg->offset - (int)g_first_offset + BANDIT_BIN_SIZE / 2;
+	if (offset < 0 || cfg->width < MIN_GLITCH_WIDTH || cfg->width > MAX_GLITCH_WIDTH)
+		return false;
+
+	*offset_bin = offset / BANDIT_BIN_SIZE;
+	*width_bin = (cfg->width - MIN_GLITCH_WIDTH) / BANDIT_BIN_SIZE;
+	return *offset_bin < BANDIT_OFFSET_BINS;
+}
+
+static void bandit_cell_add(bandit_cell_t *cell, bool success)
+{
+	if (cell->success == 0xFF || cell->failure == 0xFF)
+	{
+		// Halve the evidence instead of saturating, which keeps the ratio.
+		cell->success >>= 1;
+		cell->failure >>= 1;
+	}
+
+	if (success)
+		cell->success++;
+	else
+		cell->failure++;
+}
+
+static void bandit_depth_add(bandit_depth_t *depth, uint8_t value)
+{
+	if (depth->count == 0xFF)
+	{
+		depth->sum >>= 1;
+		depth->count >>= 1;
+	}
+
+	depth->sum += value;
+	depth->count++;
+}
+
+#if GLITCH_DEPTH_SEARCH
+// Prior scale of every offset bin, Q8. Bins whose surviving misses got further than the
+// average are favoured, in proportion to the difference; bins with too few samples are left as they are.
+static void bandit_depth_tilts(uint16_t *tilts)
+{
+	uint32_t sum = 0, count = 0;
+	for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+	{
+		tilts[i] = 0x100;
+		if (g_offset_depths[i].count >= BANDIT_DEPTH_MIN_SAMPLES)
+		{
+			sum += g_offset_depths[i].sum;
+			count += g_offset_depths[i].count;
+		}
+	}
+	if (!count)
+		return;
+
+	int32_t average = (int32_t)((sum << 8) / count); // Q8
+	for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+	{
+		const bandit_depth_t *depth = &g_offset_depths[i];
+		if (depth->count < BANDIT_DEPTH_MIN_SAMPLES)
+			continue;
+
+		int32_t mean = (int32_t)(((uint32_t)depth->sum << 8) / depth->count);
+		int32_t tilt = 0x100 + BANDIT_DEPTH_GAIN * (mean - average) / GLITCH_DEPTH_MAX;
+		if (tilt < BANDIT_DEPTH_TILT_MIN)
+			tilt = BANDIT_DEPTH_TILT_MIN;
+		if (tilt > BANDIT_DEPTH_TILT_MAX)
+			tilt = BANDIT_DEPTH_TILT_MAX;
+		tilts[i] = tilt;
+	}
+}
+#endif
+
+void bandit_init(uint16_t first_offset, uint32_t seed)
+{
+	g_rand ^= seed;
+	if (!g_rand)
+		g_rand = 0x2545F491;
+
+	if (g_first_offset == first_offset)
+		return;
+
+	g_first_offset = first_offset;
+	for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+		for (unsigned int j = 0; j < BANDIT_WIDTH_BINS; j++)
+			g_cells[i][j] = (bandit_cell_t){0};
+	for (unsigned int j = 0; j < BANDIT_WIDTH_BINS; j++)
+	{
+		g_width_timeouts[j] = 0;
+		g_width_block_reads[j] = 0;
+	}
+	for (unsigned int k = 0; k < 4; k++)
+		g_subcycles[k] = (bandit_cell_t){0};
+	for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+		g_offset_depths[i] = (bandit_depth_t){0};
+}
+
+void bandit_add_result(const glitch_cfg_t *cfg, enum GLITCH_RESULT_TYPE result, uint8_t depth)
+{
+	unsigned int offset_bin, width_bin;
+	if (!g_first_offset || !bandit_cell_index(cfg, &offset_bin, &width_bin))
+		return;
+
+	bool success = result == GLITCH_RESULT_SUCCESS;
+	bandit_cell_add(&g_cells[offset_bin][width_bin], success);
+	bandit_cell_add(&g_subcycles[cfg->subcycle_delay & 3], success);
+
+	if (result == GLITCH_RESULT_FAIL_TIMEOUT && g_width_timeouts[width_bin] < 0xFFFF)
+		g_width_timeouts[width_bin]++;
+	else if (result == GLITCH_RESULT_FAILED_MMC && g_width_block_reads[width_bin] < 0xFFFF)
+		g_width_block_reads[width_bin]++;
+
+	// Only along offset and only for attempts the boot ROM survived: whether it does depends
+	// on the width, and weaker pulses always get further; the width prior finds that edge.
+	if (result == GLITCH_RESULT_FAILED_MMC)
+		bandit_depth_add(&g_offset_depths[offset_bin], depth);
+}
+
+void bandit_next(glitch_cfg_t *cfg)
+{
+	int32_t best = INT32_MIN;
+	unsigned int best_offset = BANDIT_OFFSET_BINS / 2, best_width = BANDIT_WIDTH_BINS / 2;
+
+	uint16_t tilts[BANDIT_OFFSET_BINS];
+#if GLITCH_DEPTH_SEARCH
+	bandit_depth_tilts(tilts);
+#else
+	for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+		tilts[i] = 0x100;
+#endif
+
+	for (unsigned int j = 0; j < BANDIT_WIDTH_BINS; j++)
+	{
+		uint32_t width_prior = bandit_width_prior(j);
+		for (unsigned int i = 0; i < BANDIT_OFFSET_BINS; i++)
+		{
+			uint32_t prior = (width_prior * tilts[i]) >> 8;
+			if (prior > Q16_ONE / 2)
+				prior = Q16_ONE / 2;
+			uint32_t alpha0 = (BANDIT_PRIOR_STRENGTH * prior) >> 8;
+			uint32_t beta0 = (BANDIT_PRIOR_STRENGTH * (Q16_ONE - prior)) >> 8;
+			const bandit_cell_t *cell = &g_cells[i][j];
+			int32_t theta = bandit_sample(alpha0 + (cell->success << 8), beta0 + (cell->failure << 8));
+			if (theta > best)
+			{
+				best = theta;
+				best_offset = i;
+				best_width = j;
+			}
+		}
+	}
+
+	int32_t best_subcycle_theta = INT32_MIN;
+	for (unsigned int k = 0; k < 4; k++)
+	{
+		int32_t theta = bandit_sample(256 + (g_subcycles[k].success << 8), 256 + (g_subcycles[k].failure << 8));
+		if (theta > best_subcycle_theta)
+		{
+			best_subcycle_theta = theta;
+			cfg->subcycle_delay = k;
+		}
+	}
+
+	// Spread attempts across the whole cell so that exact values can be learned.
+	uint32_t r = bandit_rand();
+	cfg->offset = g_first_offset + best_offset * BANDIT_BIN_SIZE + (r % BANDIT_BIN_SIZE) - BANDIT_BIN_SIZE / 2;
+	cfg->width = MIN_GLITCH_WIDTH + best_width * BANDIT_BIN_SIZE + ((r >> 8) % BANDIT_BIN_SIZE);
+	if (cfg->width > MAX_GLITCH_WIDTH)
+		cfg->width = MAX_GLITCH_WIDTH;
+}
@@ -1,6 +1,89 @@
 #include "glitch_heuristic.h"
 #include <stdlib.h>
 
+#if GLITCH_HEURISTIC_SPRT
+
+// Each miss is classified as a CPU hang (timeout, no eMMC traffic) or as having had no
+// effect (boot ROM carried on reading). With h the chance of a hang at the current width,
+// two tests run side by side: h = 0.9 vs. h = 0.5 ("too long") and h = 0.1 vs. h = 0.5
+// ("too short"), with error rates of 0.1 each. Meanwhile a third test for a success chance
+// of 0.35 vs. 0.03 decides when to give up on the current offset. A silent bus is tracked
+// with a one-sided CUSUM. Log-likelihood ratios are in Q8.
+#define LLR_HANG_GIVEN_LONG 151          // ln(0.9 / 0.5)
+#define LLR_NO_EFFECT_GIVEN_LONG -412    // ln(0.1 / 0.5)
+#define LLR_BOUND 562                    // ln((1 - 0.1) / 0.1)
+#define LLR_MISS_GIVEN_BAD 102           // ln(0.97 / 0.65)
+#define LLR_NO_COMMS 399                 // ln(0.95 / 0.2)
+#define LLR_COMMS -709                   // ln(0.05 / 0.8)
+#define LLR_NO_COMMS_BOUND 1768          // ln(1 / 0.001), about 5 silent attempts in a row
+
+static void heuristic_reset_width_tests(glitch_heuristic_t *heuristic)
+{
+	heuristic->llr_too_long = 0;
+	heuristic->llr_too_short = 0;
+	heuristic->llr_move_on = 0;
+}
+
+void heuristic_add_result(glitch_heuristic_t *heuristic, enum GLITCH_RESULT_TYPE result)
+{
+	bool hang;
+	switch (result)
+	{
+		case GLITCH_RESULT_FAIL_NO_EMMC_COMMS:
+		case GLITCH_RESULT_FAIL_TIMEOUT:
+			hang = true;
+			break;
+		case GLITCH_RESULT_FAILED_MMC:
+			hang = false;
+			break;
+		default:
+			return;
+	}
+
+	heuristic->llr_too_long += hang ? LLR_HANG_GIVEN_LONG : LLR_NO_EFFECT_GIVEN_LONG;
+	heuristic->llr_too_short += hang ? LLR_NO_EFFECT_GIVEN_LONG : LLR_HANG_GIVEN_LONG;
+	heuristic->llr_move_on += LLR_MISS_GIVEN_BAD;
+
+	heuristic->llr_no_comms += result == GLITCH_RESULT_FAIL_NO_EMMC_COMMS ? LLR_NO_COMMS : LLR_COMMS;
+	if (heuristic->llr_no_comms < 0)
+		heuristic->llr_no_comms = 0;
+}
+
+void heuristic_advice(glitch_heuristic_t *heuristic, bool *fatal_abort, bool *try_next_offset, int *width_adjust, int *offset_adjust)
+{
+	heuristic->total_count++;
+	*fatal_abort = heuristic->llr_no_comms >= LLR_NO_COMMS_BOUND;
+	*try_next_offset = false;
+	*width_adjust = 0;
+	*offset_adjust = 0;
+
+	// Rejected tests stay rejected until the width changes
+	if (heuristic->llr_too_long < -LLR_BOUND)
+		heuristic->llr_too_long = -LLR_BOUND;
+	if (heuristic->llr_too_short < -LLR_BOUND)
+		heuristic->llr_too_short = -LLR_BOUND;
+
+	if (heuristic->llr_too_long >= LLR_BOUND)
+	{
+		*width_adjust = -1; // pulses mostly hang the CPU, use shorter width
+		heuristic_reset_width_tests(heuristic);
+	}
+	else if (heuristic->llr_too_short >= LLR_BOUND)
+	{
+		*width_adjust = 1; // pulses mostly have no observable effect, use longer width
+		heuristic_reset_width_tests(heuristic);
+	}
+	else if (heuristic->llr_move_on >= LLR_BOUND || heuristic->total_count >= 16)
+	{
+		// Width is fine or undecided for too long, but no success here
+		*try_next_offset = true;
+		heuristic->total_count = 0;
+		heuristic_reset_width_tests(heuristic);
+	}
+}
+
+#else
+
 void heuristic_add_result(glitch_heuristic_t *heuristic, enum GLITCH_RESULT_TYPE result)
 {
 	switch (result)
@@ -55,3 +138,5 @@ void heuristic_advice(glitch_heuristic_t *heuristic, bool *fatal_abort, bool *tr
 		heuristic->total_count %= 16;
 	}
 }
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glitch_timeout.h>
+#include <config.h>
+
+// The FPGA flags a timeout once the bus has been silent for the programmed window.
+// A hang stops all traffic at the pulse, so elapsed - window of a hang is when the
+// pulse fired after arming; the same for an MMC read is when its traffic stopped,
+// and a success is flagged as soon as its traffic shows up. Any silence the window
+// has to bridge is shorter than the latter two, counted from the pulse.
+#define GLITCH_TIMEOUT_QUANTILE_PERCENT 98
+#define GLITCH_TIMEOUT_PULSE_STEP_US 50
+
+static uint8_t g_latency_hist[CONFIG_DEFAULT_TIMEOUT]; // traffic latency after the pulse, in timeout units
+static uint16_t g_samples;
+static uint32_t g_pulse_us; // running median of arming until pulse, 0 until the first hang
+static uint8_t g_latency_units;
+static uint8_t g_learned;
+static uint8_t g_attempts;
+
+static void glitch_timeout_update()
+{
+	unsigned int total = 0;
+	for (unsigned int i = 0; i < CONFIG_DEFAULT_TIMEOUT; i++)
+		total += g_latency_hist[i];
+
+	unsigned int below = 0, units = 0;
+	while (units < CONFIG_DEFAULT_TIMEOUT - 1 && below + g_latency_hist[units] < (total * GLITCH_TIMEOUT_QUANTILE_PERCENT + 99) / 100)
+		below += g_latency_hist[units++];
+	g_latency_units = units + 1;
+
+	if (g_samples < GLITCH_TIMEOUT_MIN_SAMPLES)
+		return;
+
+	// 25% and two units of margin for the coarse unit and late outliers
+	unsigned int timeout = g_latency_units + g_latency_units / 4 + 2;
+	if (timeout < GLITCH_TIMEOUT_MIN)
+		timeout = GLITCH_TIMEOUT_MIN;
+	if (timeout > CONFIG_DEFAULT_TIMEOUT)
+		timeout = CONFIG_DEFAULT_TIMEOUT;
+	g_learned = timeout;
+}
+
+uint8_t glitch_timeout_next(uint8_t timeout)
+{
+	// Waiting the full default now and then keeps late traffic from going unnoticed,
+	// which would otherwise only ever shrink the learned window.
+	if ((++g_attempts % GLITCH_TIMEOUT_PROBE_INTERVAL) == 0)
+		return CONFIG_DEFAULT_TIMEOUT;
+
+	if (g_learned && g_learned < timeout)
+		return g_learned;
+	return timeout;
+}
+
+void glitch_timeout_add_result(uint8_t timeout, enum GLITCH_RESULT_TYPE result, uint32_t elapsed_us)
+{
+	uint32_t window_us = (uint32_t)timeout * GLITCH_TIMEOUT_UNIT_US;
+	uint32_t traffic_us;
+	switch (result)
+	{
+		case GLITCH_RESULT_FAIL_TIMEOUT:
+			if (elapsed_us <= window_us)
+				return;
+			if (!g_pulse_us)
+				g_pulse_us = elapsed_us - window_us;
+			else if (elapsed_us - window_us > g_pulse_us)
+				g_pulse_us += GLITCH_TIMEOUT_PULSE_STEP_US;
+			else if (g_pulse_us > GLITCH_TIMEOUT_PULSE_STEP_US)
+				g_pulse_us -= GLITCH_TIMEOUT_PULSE_STEP_US;
+			return;
+
+		case GLITCH_RESULT_SUCCESS:
+			traffic_us = elapsed_us;
+			break;
+
+		case GLITCH_RESULT_FAILED_MMC:
+			if (elapsed_us <= window_us)
+				return;
+			traffic_us = elapsed_us - window_us;
+			break;
+
+		default:
+			return;
+	}
+
+	if (!g_pulse_us)
+		return;
+
+	unsigned int units = traffic_us > g_pulse_us ? (traffic_us - g_pulse_us) / GLITCH_TIMEOUT_UNIT_US : 0;
+	if (units >= CONFIG_DEFAULT_TIMEOUT)
+		units = CONFIG_DEFAULT_TIMEOUT - 1;
+
+	if (g_latency_hist[units] == 0xFF)
+	{
+		// Halve the evidence instead of saturating, so that the estimate keeps tracking
+		for (unsigned int i = 0; i < CONFIG_DEFAULT_TIMEOUT; i++)
+			g_latency_hist[i] >>= 1;
+	}
+	g_latency_hist[units]++;
+	if (g_samples < 0xFFFF)
+		g_samples++;
+
+	glitch_timeout_update();
+}
+
+uint8_t glitch_timeout_learned()
+{
+	return g_learned;
+}
+
+uint16_t glitch_timeout_latency_us()
+{
+	return g_latency_units * GLITCH_TIMEOUT_UNIT_US;
+}
@@ -72,5 +72,6 @@ logger null_logger =
 	null_logger_glitch_result,
 	null_logger_end,
 	null_logger_adc,
-	null_logger_stats
+	null_logger_stats,
+	false
 };
\ No newline at end of file
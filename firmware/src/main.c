@@ -24,36 +24,51 @@
 #include <adc.h>
 #include <glitch.h>
 #include <clock.h>
+#include <config.h>
 #include <sdio.h>
 #include <timer.h>
 #include <session_info.h>
+#include <profile.h>
 
-void systick_irq_config(void)
-{
-	SysTick->CTRL |= (1UL << 1);
-	nvic_priority_group_set(NVIC_PRIGROUP_PRE2_SUB2);
-	nvic_irq_enable((uint8_t)SysTick_IRQn, 1U, 0U);
-}
-
-void systick_irq_disable(void)
-{
-	SysTick->CTRL &= ~(1UL << 1);
-	nvic_irq_disable((uint8_t)SysTick_IRQn);
-}
+// PF7 sync with the FPGA: settling time of each read, how long it may read high with either
+// pull before that counts as a failed sync, and how long it may be held low
+#define FPGA_SYNC_SETTLE_US 5000
+#define FPGA_SYNC_STUCK_US 70000
+#define FPGA_SYNC_TIMEOUT_US 1000000
 
 void enter_sleep()
 {
-	systick_irq_disable();
+	config_commit();
 	leds_off();
 	fpga_power_off();
 	while (1)
 		pmu_to_standbymode(WFI_CMD);
 }
 
+// Run the FPGA link at the SPI clock trained on an earlier boot; train it if there is
+// none yet or it stopped working. The legacy default is trusted without a test.
+static void fpga_link_setup()
+{
+	config_t cfg;
+	config_load(&cfg);
+
+	uint8_t divider = cfg.spi_divider;
+	if (divider == FPGA_LINK_DIVIDER_DEFAULT)
+		return;
+	if (divider >= FPGA_LINK_DIVIDER_FASTEST && divider <= FPGA_LINK_DIVIDER_SLOWEST && !fpga_link_test(divider, 1))
+	{
+		fpga_link_set(divider);
+		return;
+	}
+
+	cfg.spi_divider = fpga_link_train();
+	config_stage(&cfg); // written with the glitch session
+}
+
 void firmware_main()
 {
 	delay_init();
-	systick_irq_config();
+	nvic_priority_group_set(NVIC_PRIGROUP_PRE2_SUB2);
 	timer_global_init();
 	clocks_init();
 	leds_init();
@@ -63,21 +78,27 @@ void firmware_main()
 	adc_init(CONSOLE_STATE_ADC_PORT, CONSOLE_STATE_ADC_PIN, 3);
 	g_session_info.startup_adc_value = adc_wait_eoc_read();
 
-	int syncAttempt = 100;
 	SCB->CCR = SCB->CCR & ~(1 << 3); // no hardfault on UA
 
+	// Each read of PF7 waits for the pin to follow the pull, up to the settling time. The
+	// budgets are kept in time, as reads that don't have to wait are much shorter.
+	uint32_t span = profile_begin(PROFILE_FPGA_SYNC);
 	while (1)
 	{
+		uint32_t waited_us;
 		gpio_mode_set(GPIOF, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, BIT(7));
-		delay_ms(5u);
+		bool ready = delay_until_pin(GPIOF, BIT(7), 1, FPGA_SYNC_SETTLE_US, &waited_us);
+		profile_wait(PROFILE_WAIT_SYNC_PULL_UP, ready, waited_us);
 		int pinWhilePulledUp = gpio_input_bit_get(GPIOF, BIT(7));
 
 		// configure GPIO to input with pull-down
 		gpio_mode_set(GPIOF, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, BIT(7));
-		delay_ms(5u);
+		ready = delay_until_pin(GPIOF, BIT(7), 0, FPGA_SYNC_SETTLE_US, &waited_us);
+		profile_wait(PROFILE_WAIT_SYNC_PULL_DOWN, ready, waited_us);
 		int pinWhilePulledDown = gpio_input_bit_get(GPIOF, BIT(7));
 
-		if (pinWhilePulledDown && pinWhilePulledUp && syncAttempt < 95)
+		uint32_t elapsed_us = timer_get_global_total() - span;
+		if (pinWhilePulledDown && pinWhilePulledUp && elapsed_us >= FPGA_SYNC_STUCK_US)
 		{
 			fpga_sync_failed = 1;
 			break;
@@ -86,42 +107,45 @@ void firmware_main()
 		{
 			break;
 		}
-		if (syncAttempt == 0)
+		if (elapsed_us >= FPGA_SYNC_TIMEOUT_US)
 		{
 			config_reset();
 			leds_set_pattern(&lp_config_reset);
 			while (1) ;
 		}
-		--syncAttempt;
 	}
+	profile_end(PROFILE_FPGA_SYNC, span);
 
 	if (fpga_reset() != OK_FPGA_RESET)
 	{
 		leds_set_pattern(&lp_err_fpga);
 		while (1);
 	}
+	span = profile_begin(PROFILE_FPGA_LINK);
+	fpga_link_setup();
+	profile_end(PROFILE_FPGA_LINK, span);
 
 	if (g_session_info.startup_adc_value < 1596)
 	{
-		config_t cfg;
-		if (config_load(&cfg) == ERR_CONFIG_NOT_FILLED)
+		if (!config_get()->count)
 		{
-			int trains_left = 50;
+			span = profile_begin(PROFILE_TRAINING);
+			glitch_train_t train;
+			glitch_train_init(&train);
+			bool trained;
 			uint32_t status;
 			do
 			{
 				session_info_t local_si = {0};
 				status = glitch(&null_logger, &local_si, true);
 				if (status == OK_GLITCH_SUCCESS)
-				{
-					trains_left--;
 					leds_override(100, &lp_glitch_done); // green blink
-				}
-			} while (trains_left && (status != ERR_UNKNOWN_DEVICE && status != ERR_MMC_STATE_UNEXPECTED_NOT_IDENT));
+				trained = glitch_train_add(&train, status, &local_si);
+			} while (!trained && (status != ERR_UNKNOWN_DEVICE && status != ERR_MMC_STATE_UNEXPECTED_NOT_IDENT));
+			profile_end(PROFILE_TRAINING, span);
 		}
 
 		enum STATUSCODE status = glitch(&null_logger, &g_session_info, false);
-		systick_irq_disable();
 
 		if (status == OK_GLITCH_SUCCESS)
 			sdio_handler();
@@ -19,10 +19,11 @@
 #include <fpga.h>
 #include <delay.h>
 #include <statuscode.h>
+#include <timer.h>
 #include "mmc_defs.h"
 #include "sd.h"
 
-int crc7(uint8_t *buffer, int size)
+int crc7(const uint8_t *buffer, int size)
 {
 	uint8_t crc = 0;
 	for (int i = 0; i < size; i++)
@@ -40,50 +41,83 @@ int crc7(uint8_t *buffer, int size)
 	return crc;
 }
 
+// Last byte of a command frame in FPGA_BUFFER_CMD, telling the FPGA what to do with it
+#define MMC_DESC_COMMAND 0x01 // send the command frame and receive its response
+#define MMC_DESC_READ 0x02 // receive a data block into FPGA_BUFFER_CMD_DATA
+#define MMC_DESC_WRITE 0x04 // send the data block in FPGA_BUFFER_CMD_DATA
+#define MMC_DESC_LONG 0x08 // 136-bit response
+
+// SEND_OP_COND polls back off from a fraction of a millisecond to the fixed interval they
+// used to have, for about as long in total as its 100 polls
+#define MMC_OP_COND_POLL_MIN_US 125
+#define MMC_OP_COND_POLL_MAX_US 10000
+#define MMC_OP_COND_TIMEOUT_US 1000000
+
+// R1 bits of a card turning down an erase sequence
+#define MMC_ERASE_ERRORS (R1_OUT_OF_RANGE | R1_ADDRESS_ERROR | R1_ERASE_SEQ_ERROR | R1_ERASE_PARAM | \
+	R1_WP_VIOLATION | R1_ILLEGAL_COMMAND | R1_ERROR | R1_WP_ERASE_SKIP)
+
+// What mmc_erase() needs from EXT_CSD, read on its first call after mmc_initialize()
+static struct
+{
+	uint8_t known;
+	uint8_t trim; // SEC_FEATURE_SUPPORT has GB_CL_EN, which TRIM comes with
+	uint8_t trim_mult; // TRIM timeout in 300ms units
+} g_erase_info;
+
+mmc_bringup_t g_mmc_bringup;
+
+// Set once the card didn't come up after a short reset
+static uint8_t g_mmc_clock_stuck = !MMC_FAST_RESET;
+
+static int mmc_run_descriptor(const uint8_t *frame)
+{
+	fpga_select_active_buffer(FPGA_BUFFER_CMD);
+	fpga_write_buffer((uint8_t *)frame, 7);
+	fpga_do_mmc_command();
+
+	uint8_t flags;
+	fpga_wait_event(FPGA_EVENT_MMC_CMD_DONE, 100000, &flags);
+	return (flags & FPGA_MMC_BUSY_SENDING) ? -1 : 0;
+}
+
 int mmc_send_command(uint32_t cmd, uint32_t argument, uint32_t *res, uint8_t *io)
 {
 	uint8_t data[7];
 	data[0] = cmd | 0x40;
 	*(uint32_t *) &data[1] = __builtin_bswap32(argument);
 	data[5] = (crc7(data, 5) << 1) | 1;
-	data[6] = 1;
+	data[6] = MMC_DESC_COMMAND;
 
 	switch (cmd)
 	{
 		case MMC_READ_SINGLE_BLOCK:
-			data[6] = 3;
+		case MMC_SEND_EXT_CSD:
+			data[6] |= MMC_DESC_READ;
 			break;
 
 		case MMC_WRITE_BLOCK:
-			data[6] = 5;
+			data[6] |= MMC_DESC_WRITE;
 			if (io)
 			{
-				fpga_select_active_buffer(1);
-				fpga_write_buffer(io, 512);
+				fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
+				fpga_write_buffer(io, MMC_BLOCK_SIZE);
 			}
 			break;
 
 		case MMC_ALL_SEND_CID:
 		case MMC_SEND_CSD:
-			data[6] |= 8;
+			data[6] |= MMC_DESC_LONG;
 			break;
 	}
 
-	fpga_select_active_buffer(0);
-	fpga_write_buffer(data, 7);
-	fpga_do_mmc_command();
-
-	int retry = 2000;
-	while (fpga_read_mmc_flags() & 1)
-	{
-		if (!--retry)
-			return -1;
-		delay_us(50);
-	}
+	if (mmc_run_descriptor(data))
+		return -1;
 
-	fpga_select_active_buffer(0);
-	uint8_t tmp[32];
-	fpga_read_buffer(tmp, 32);
+	// Only as much of the response as there is, behind the index byte
+	uint8_t tmp[17];
+	fpga_select_active_buffer(FPGA_BUFFER_CMD);
+	fpga_read_buffer(tmp, (data[6] & MMC_DESC_LONG) ? 17 : 6);
 
 	if (res)
 	{
@@ -94,36 +128,57 @@ int mmc_send_command(uint32_t cmd, uint32_t argument, uint32_t *res, uint8_t *io
 			*res = __builtin_bswap32(*(uint32_t *) &tmp[1]);
 	}
 
-	if (cmd == 17 && io)
+	if ((data[6] & MMC_DESC_READ) && io)
 	{
-		fpga_select_active_buffer(1);
-		fpga_read_buffer(io, 512);
+		fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
+		fpga_read_buffer(io, MMC_BLOCK_SIZE);
 	}
 
 	return 0;
 }
 
-uint32_t mmc_initialize(uint8_t *cid)
+static uint32_t mmc_wait_ready()
+{
+	uint32_t start_us = timer_global_get_us();
+	if (mmc_send_command(MMC_SEND_OP_COND, 0, 0, 0))
+		return ERR_MMC_SEND_OP_COND_FAILED;
+
+	uint32_t poll_us = MMC_OP_COND_POLL_MIN_US;
+	for (;;)
+	{
+		uint32_t res;
+		if (mmc_send_command(MMC_SEND_OP_COND, SD_OCR_CCS | SD_OCR_VDD_18, &res, 0))
+			return ERR_MMC_SEND_OP_COND_FAILED;
+
+		if (g_mmc_bringup.op_cond_polls < 0xFF)
+			g_mmc_bringup.op_cond_polls++;
+		if ((res & 0xFF000000) == (MMC_CARD_BUSY | SD_OCR_CCS))
+			break;
+
+		if (timer_global_get_us() - start_us >= MMC_OP_COND_TIMEOUT_US)
+			return ERR_MMC_SEND_OP_COND_FAILED;
+
+		delay_us(poll_us);
+		poll_us = poll_us * 2 < MMC_OP_COND_POLL_MAX_US ? poll_us * 2 : MMC_OP_COND_POLL_MAX_US;
+	}
+
+	g_mmc_bringup.op_cond_us = timer_global_get_us() - start_us;
+	return 0;
+}
+
+static uint32_t mmc_bring_up(uint8_t *cid, int clock_stuck)
 {
-	fpga_reset_device(1);
+	uint32_t start_us = timer_global_get_us();
+	fpga_reset_device(clock_stuck);
+	g_mmc_bringup.reset_us += timer_global_get_us() - start_us;
 
 	uint32_t res;
 	if (mmc_send_command(MMC_GO_IDLE_STATE, 0, 0, 0))
 		return ERR_MMC_GO_IDLE_FAILED;
 
-	if (!mmc_send_command(MMC_SEND_OP_COND, 0, 0, 0))
-	{
-		int retry = 100;
-		while (!mmc_send_command(MMC_SEND_OP_COND, SD_OCR_CCS | SD_OCR_VDD_18, &res, 0))
-		{
-			if ((res & 0xFF000000) == (MMC_CARD_BUSY | SD_OCR_CCS))
-				break;
-
-			delay_ms(10);
-			if (!--retry)
-				return ERR_MMC_SEND_OP_COND_FAILED;
-		}
-	}
+	uint32_t status = mmc_wait_ready();
+	if (status)
+		return status;
 
 	uint32_t cid_res[4];
 	if (mmc_send_command(MMC_ALL_SEND_CID, 0, cid_res, 0))
@@ -171,6 +226,36 @@ uint32_t mmc_initialize(uint8_t *cid)
 	return 0;
 }
 
+uint32_t mmc_initialize(uint8_t *cid)
+{
+	uint32_t start_us = timer_global_get_us();
+	memset(&g_mmc_bringup, 0, sizeof(g_mmc_bringup));
+	g_erase_info.known = 0;
+
+	// Anything going wrong after the short reset may just as well be the console's boot ROM
+	// still on the bus, which the clock-stuck reset is there to silence
+	uint32_t ret = ERR_MMC_GO_IDLE_FAILED;
+	if (!g_mmc_clock_stuck)
+	{
+		ret = mmc_bring_up(cid, 0);
+		g_mmc_clock_stuck = ret != 0;
+	}
+	if (ret)
+	{
+		g_mmc_bringup.clock_stuck = 1;
+		g_mmc_bringup.op_cond_polls = 0;
+		ret = mmc_bring_up(cid, 1);
+	}
+
+	g_mmc_bringup.total_us = timer_global_get_us() - start_us;
+	return ret;
+}
+
+void mmc_escalate_reset()
+{
+	g_mmc_clock_stuck = 1;
+}
+
 uint32_t mmc_read(uint32_t offset, uint8_t *block)
 {
 	uint32_t res;
@@ -196,22 +281,72 @@ uint32_t mmc_write(uint32_t offset, const uint8_t *block)
 	return 0;
 }
 
+uint32_t mmc_read_blocks(uint32_t offset, uint32_t count, uint8_t *blocks)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t status = mmc_read(offset + i, &blocks[i * MMC_BLOCK_SIZE]);
+		if (status)
+			return status;
+	}
+
+	return 0;
+}
+
+// Write count blocks from offset, block i from blocks + i * stride. A stride of 0 writes the
+// same block count times; it is sent to the FPGA for each of them all the same.
+static uint32_t mmc_write_run(uint32_t offset, uint32_t count, const uint8_t *blocks, uint32_t stride)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t res;
+		if (mmc_send_command(MMC_WRITE_BLOCK, offset + i, &res, (uint8_t *) &blocks[i * stride]))
+			return ERR_MMC_WRITE_SINGLE_BLOCK_FAILED;
+
+		if (R1_CURRENT_STATE(res) != R1_STATE_TRAN)
+			return ERR_MMC_STATE_UNEXPECTED_NOT_TRAN5;
+	}
+
+	return 0;
+}
+
+uint32_t mmc_write_blocks(uint32_t offset, uint32_t count, const uint8_t *blocks)
+{
+	return mmc_write_run(offset, count, blocks, MMC_BLOCK_SIZE);
+}
+
+// Compare len bytes at offset with buffer and rewrite what differs, each run of differing
+// blocks with one mmc_write_blocks()
 uint32_t mmc_check_and_if_different_write(uint32_t offset, const uint8_t *buffer, uint32_t len)
 {
-	uint8_t tmp[512];
+	uint8_t tmp[MMC_BLOCK_SIZE];
 	memset(tmp, 0, sizeof(tmp));
 	len = (len + sizeof(tmp) - 1) / sizeof(tmp);
 
-	for (int i = 0; i < len; i++)
+	uint32_t run_start = 0, run_count = 0;
+	for (uint32_t i = 0; i <= len; i++)
 	{
-		uint32_t status = mmc_read(offset + i, tmp);
-		if (status)
-			return status;
-		if (memcmp(tmp, &buffer[i * sizeof(tmp)], sizeof(tmp)))
+		int differs = 0;
+		if (i < len)
+		{
+			uint32_t status = mmc_read(offset + i, tmp);
+			if (status)
+				return status;
+			differs = memcmp(tmp, &buffer[i * sizeof(tmp)], sizeof(tmp)) != 0;
+		}
+
+		if (differs)
+		{
+			if (!run_count)
+				run_start = i;
+			run_count++;
+		}
+		else if (run_count)
 		{
-			status = mmc_write(offset + i, &buffer[i * sizeof(tmp)]);
+			uint32_t status = mmc_write_blocks(offset + run_start, run_count, &buffer[run_start * sizeof(tmp)]);
 			if (status)
 				return status;
+			run_count = 0;
 		}
 	}
 
@@ -220,9 +355,8 @@ uint32_t mmc_check_and_if_different_write(uint32_t offset, const uint8_t *buffer
 
 uint32_t mmc_check_and_if_header_different_write_all(uint32_t offset, const uint8_t *buffer, uint32_t len)
 {
-	uint8_t tmp[512];
+	uint8_t tmp[MMC_BLOCK_SIZE];
 	memset(tmp, 0, sizeof(tmp));
-	len = (len + sizeof(tmp) - 1) / sizeof(tmp);
 
 	// Read header.
 	uint32_t status = mmc_read(offset, tmp);
@@ -231,30 +365,17 @@ uint32_t mmc_check_and_if_header_different_write_all(uint32_t offset, const uint
 
 	// Skip bad block table and check if signature doesn't match.
 	if (memcmp(&tmp[0x10], &buffer[0x10], 0x100))
-	{
-		for (int i = 0; i < len; i++)
-		{
-			uint32_t status = mmc_read(offset + i, tmp);
-			if (status)
-				return status;
-			if (memcmp(tmp, &buffer[i * sizeof(tmp)], sizeof(tmp)))
-			{
-				status = mmc_write(offset + i, &buffer[i * sizeof(tmp)]);
-				if (status)
-					return status;
-			}
-		}
-	}
+		return mmc_check_and_if_different_write(offset, buffer, len);
 
 	return 0;
 }
 
 uint32_t mmc_copy(uint32_t dest, uint32_t source, uint32_t len)
 {
-	uint8_t tmp[512];
+	uint8_t tmp[MMC_BLOCK_SIZE];
 	len = (len + sizeof(tmp) - 1) / sizeof(tmp);
 
-	for (int i = 0; i < len; i++)
+	for (uint32_t i = 0; i < len; i++)
 	{
 		uint32_t status = mmc_read(source + i, tmp);
 		if (status)
@@ -267,18 +388,98 @@ uint32_t mmc_copy(uint32_t dest, uint32_t source, uint32_t len)
 	return 0;
 }
 
-uint32_t mmc_erase(uint32_t offset, uint32_t len)
+static uint32_t mmc_read_erase_info()
 {
-	uint8_t tmp[512];
-	memset(tmp, 0, sizeof(tmp));
-	len = (len + sizeof(tmp) - 1) / sizeof(tmp);
+	uint8_t ext_csd[MMC_BLOCK_SIZE];
+	uint32_t res;
+	if (mmc_send_command(MMC_SEND_EXT_CSD, 0, &res, ext_csd))
+		return ERR_MMC_SEND_EXT_CSD_FAILED;
+
+	if (R1_CURRENT_STATE(res) != R1_STATE_TRAN)
+		return ERR_MMC_STATE_UNEXPECTED_NOT_TRAN7;
+
+	g_erase_info.trim = (ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] & EXT_CSD_SEC_GB_CL_EN) != 0;
+	g_erase_info.trim_mult = ext_csd[EXT_CSD_TRIM_MULT];
+	g_erase_info.known = 1;
+	return 0;
+}
+
+// Sends an erase sequence command, refused is set when the card turns it down
+static uint32_t mmc_erase_command(uint32_t cmd, uint32_t argument, int *refused)
+{
+	uint32_t res;
+	if (mmc_send_command(cmd, argument, &res, 0))
+		return ERR_MMC_ERASE_FAILED;
+
+	if (R1_CURRENT_STATE(res) != R1_STATE_TRAN)
+		return ERR_MMC_STATE_UNEXPECTED_NOT_TRAN7;
+
+	*refused = (res & MMC_ERASE_ERRORS) != 0;
+	return 0;
+}
 
-	for (int i = 0; i < len; i++)
+// TRIM count blocks from offset: three commands, then wait out the busy ERASE leaves the card in.
+// trimmed stays 0 when the card doesn't support it or refuses the range.
+static uint32_t mmc_trim(uint32_t offset, uint32_t count, int *trimmed)
+{
+	*trimmed = 0;
+	if (!g_erase_info.known)
 	{
-		uint32_t status = mmc_write(offset + i, tmp);
+		uint32_t status = mmc_read_erase_info();
 		if (status)
 			return status;
 	}
+	if (!g_erase_info.trim)
+		return 0;
+
+	int refused = 0;
+	uint32_t status = mmc_erase_command(MMC_ERASE_GROUP_START, offset, &refused);
+	if (!status && !refused)
+		status = mmc_erase_command(MMC_ERASE_GROUP_END, offset + count - 1, &refused);
+	if (!status && !refused)
+		status = mmc_erase_command(MMC_ERASE, MMC_TRIM_ARG, &refused);
+	if (status || refused)
+		return status;
 
-	return 0;
-}
\ No newline at end of file
+	uint32_t timeout_ms = 300 * (g_erase_info.trim_mult ? g_erase_info.trim_mult : 1);
+	for (uint32_t elapsed_ms = 0;; elapsed_ms++)
+	{
+		uint32_t res;
+		if (mmc_send_command(MMC_SEND_STATUS, 2 << 16, &res, 0))
+			return ERR_MMC_SEND_STATUS_FAILED;
+
+		if (R1_CURRENT_STATE(res) == R1_STATE_TRAN)
+		{
+			*trimmed = !(res & MMC_ERASE_ERRORS);
+			return 0;
+		}
+
+		if (R1_CURRENT_STATE(res) != R1_STATE_PRG)
+			return ERR_MMC_STATE_UNEXPECTED_NOT_TRAN7;
+
+		if (elapsed_ms >= timeout_ms)
+			return ERR_MMC_ERASE_TIMEOUT;
+		delay_ms(1);
+	}
+}
+
+static uint32_t mmc_erase_zero(uint32_t offset, uint32_t count)
+{
+	uint8_t tmp[MMC_BLOCK_SIZE];
+	memset(tmp, 0, sizeof(tmp));
+	return mmc_write_run(offset, count, tmp, 0);
+}
+
+// TRIM len bytes at offset, or write zeroes over them on a card without it. A trimmed block
+// reads as EXT_CSD ERASED_MEM_CONT, zeroes or ones.
+uint32_t mmc_erase(uint32_t offset, uint32_t len)
+{
+	len = (len + MMC_BLOCK_SIZE - 1) / MMC_BLOCK_SIZE;
+
+	int trimmed;
+	uint32_t status = mmc_trim(offset, len, &trimmed);
+	if (status || trimmed)
+		return status;
+
+	return mmc_erase_zero(offset, len);
+}
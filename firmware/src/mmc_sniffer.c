@@ -1,44 +1,175 @@
 #include "mmc_sniffer.h"
 #include "mmc_defs.h"
+#include <mmc.h>
 
-void mmc_sniff_parser_init(mmc_sniff_parser_ctx *ctx, uint8_t *data, int datalen)
+enum MMC_SNIFF_RESPONSE
 {
-	ctx->data = data;
-	ctx->datalen = datalen;
-	ctx->cmd = 0;
+	MMC_SNIFF_R1 = 0, // and R1b
+	MMC_SNIFF_NONE,
+	MMC_SNIFF_R2, // CID or CSD, 136 bits
+	MMC_SNIFF_R3, // OCR, no CRC
+};
+
+typedef struct
+{
+	uint8_t response; // MMC_SNIFF_RESPONSE
+	uint8_t state; // card state the command leads to, as MMC_SNIFF_STATE(); 0 if none
+	uint8_t seen; // MMC_SNIFF_SEEN_*
+} mmc_sniff_command_t;
+
+#define MMC_SNIFF_STATE(s) ((s) + 1)
+
+// Commands not listed get an R1 and leave the state to it
+static const mmc_sniff_command_t g_commands[64] =
+{
+	[MMC_GO_IDLE_STATE] = {MMC_SNIFF_NONE, MMC_SNIFF_STATE(R1_STATE_IDLE), MMC_SNIFF_SEEN_RESET},
+	[MMC_SEND_OP_COND] = {MMC_SNIFF_R3, MMC_SNIFF_STATE(R1_STATE_READY), MMC_SNIFF_SEEN_IDENT},
+	[MMC_ALL_SEND_CID] = {MMC_SNIFF_R2, MMC_SNIFF_STATE(R1_STATE_IDENT), MMC_SNIFF_SEEN_IDENT},
+	[MMC_SET_RELATIVE_ADDR] = {MMC_SNIFF_R1, MMC_SNIFF_STATE(R1_STATE_STBY), MMC_SNIFF_SEEN_IDENT},
+	[MMC_SET_DSR] = {MMC_SNIFF_NONE, 0, 0},
+	[MMC_SELECT_CARD] = {MMC_SNIFF_R1, MMC_SNIFF_STATE(R1_STATE_TRAN), 0},
+	[MMC_SEND_CSD] = {MMC_SNIFF_R2, 0, 0},
+	[MMC_SEND_CID] = {MMC_SNIFF_R2, 0, 0},
+	[MMC_GO_INACTIVE_STATE] = {MMC_SNIFF_NONE, MMC_SNIFF_STATE(R1_STATE_DIS), 0},
+	// Data phases are not captured, a single block read is back in TRAN when the next command comes
+	[MMC_READ_SINGLE_BLOCK] = {MMC_SNIFF_R1, MMC_SNIFF_STATE(R1_STATE_TRAN), MMC_SNIFF_SEEN_BLOCK_READ},
+	[MMC_READ_MULTIPLE_BLOCK] = {MMC_SNIFF_R1, MMC_SNIFF_STATE(R1_STATE_DATA), MMC_SNIFF_SEEN_BLOCK_READ},
+};
+
+static uint32_t mmc_sniff_be32(const uint8_t *data)
+{
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
 }
 
-enum MMC_SNIFFER_PACKET_TYPE mmc_sniff_parser_parse(mmc_sniff_parser_ctx *ctx)
+// Response type of a frame that isn't a command. A response at the start of a capture
+// answers a command from before it; go by its index field then. R2 and R3 carry 0x3F
+// there instead, an R3 ends in all ones where the others have their CRC7.
+static uint8_t mmc_sniff_response(const mmc_sniff_t *sniff, const uint8_t *data)
 {
-	if (ctx->datalen < 6)
-		return MMC_SNIFF_PKT_TYPE_INVALID; // insufficient data left to sniff full command
+	if (sniff->pending_cmd != 0xFF)
+		return g_commands[sniff->pending_cmd].response;
+	if ((data[0] & 0x3F) == 0x3F)
+		return data[MMC_SNIFF_FRAME_LEN - 1] == 0xFF ? MMC_SNIFF_R3 : MMC_SNIFF_R2;
+	return g_commands[data[0] & 0x3F].response;
+}
+
+static void mmc_sniff_add_event(mmc_sniff_t *sniff, uint8_t type, uint8_t cmd, uint8_t flags, uint32_t arg)
+{
+	if (sniff->count >= MMC_SNIFF_MAX_EVENTS)
+		return;
 
-	uint8_t *data = ctx->data;
-	char flags = data[0];
-	ctx->cmd = flags & 0x3F;
+	mmc_sniff_event_t *ev = &sniff->events[sniff->count++];
+	ev->type = type;
+	ev->cmd = cmd;
+	ev->flags = flags;
+	ev->state = sniff->state;
+	ev->arg = arg;
+}
 
-	enum MMC_SNIFFER_PACKET_TYPE packet_type;
-	if (flags & 0x40) // host --> device command
+void mmc_sniff_init(mmc_sniff_t *sniff)
+{
+	sniff->count = 0;
+	sniff->frames = 0;
+	sniff->bad_frames = 0;
+	sniff->unpaired = 0;
+	sniff->seen = 0;
+	sniff->state = 0xFF;
+	sniff->pending_cmd = 0xFF;
+	sniff->in_bad_frame = 0;
+	sniff->block_reads = 0;
+	sniff->last_sector = 0;
+}
+
+unsigned int mmc_sniff_frame_length(const mmc_sniff_t *sniff, const uint8_t *data)
+{
+	if (!(data[0] & 0x40) && mmc_sniff_response(sniff, data) == MMC_SNIFF_R2)
+		return MMC_SNIFF_R2_FRAME_LEN;
+	return MMC_SNIFF_FRAME_LEN;
+}
+
+unsigned int mmc_sniff_frame(mmc_sniff_t *sniff, const uint8_t *data)
+{
+	uint8_t first = data[0];
+	uint8_t index = first & 0x3F;
+	int command = first & 0x40;
+	uint8_t response = command ? MMC_SNIFF_R1 : mmc_sniff_response(sniff, data);
+	unsigned int len = mmc_sniff_frame_length(sniff, data);
+
+	// Start bit 0, end bit 1 and the CRC7 over everything in between
+	int valid = !(first & 0x80) && (data[len - 1] & 1);
+	if (valid && response == MMC_SNIFF_R2)
+		valid = crc7(data + 1, len - 2) == data[len - 1] >> 1;
+	else if (valid && response == MMC_SNIFF_R3)
+		valid = data[len - 1] == 0xFF;
+	else if (valid)
+		valid = crc7(data, len - 1) == data[len - 1] >> 1;
+
+	if (!valid)
 	{
-		packet_type = MMC_SNIFF_PKT_TYPE_COMMAND;
-		// Host commands are always 48-bit in length
-		ctx->data += 6;
-		ctx->datalen -= 6;
+		// Resynchronize byte by byte; a run of garbage is one event
+		if (!sniff->in_bad_frame)
+		{
+			sniff->bad_frames++;
+			mmc_sniff_add_event(sniff, MMC_SNIFF_EVENT_BAD_FRAME, index, 0, mmc_sniff_be32(data + 1));
+		}
+		sniff->in_bad_frame = 1;
+		return 1;
 	}
-	else if (ctx->cmd == MMC_ALL_SEND_CID || ctx->cmd == MMC_SEND_CSD || ctx->cmd == MMC_SEND_CID)
+
+	sniff->in_bad_frame = 0;
+	uint32_t arg = mmc_sniff_be32(data + 1);
+	if (command)
 	{
-		// These 3 commands prompt an 'R2' response type of 136 bit length
-		packet_type = MMC_SNIFF_PKT_TYPE_RESPONSE136;
-		ctx->data += 17;
-		ctx->datalen -= 17;
+		const mmc_sniff_command_t *cmd = &g_commands[index];
+		sniff->seen |= cmd->seen;
+		if (cmd->seen & MMC_SNIFF_SEEN_BLOCK_READ)
+		{
+			sniff->last_sector = arg;
+			if (sniff->block_reads < 0xFF)
+				sniff->block_reads++;
+			if (arg < MMC_SNIFF_BCT_END_SECTOR)
+				sniff->seen |= MMC_SNIFF_SEEN_BCT_READ;
+			else if (arg >= MMC_SNIFF_PAYLOAD_SECTOR)
+				sniff->seen |= MMC_SNIFF_SEEN_PAYLOAD_READ;
+		}
+		if (cmd->state)
+			sniff->state = cmd->state - 1;
+		sniff->pending_cmd = cmd->response == MMC_SNIFF_NONE ? 0xFF : index;
+		mmc_sniff_add_event(sniff, MMC_SNIFF_EVENT_COMMAND, index, 0, arg);
 	}
 	else
 	{
-		// All other commands receive a 48-bit response
-		packet_type = MMC_SNIFF_PKT_TYPE_RESPONSE48;
-		ctx->data += 6;
-		ctx->datalen -= 6;
+		uint8_t cmd = sniff->pending_cmd;
+		uint8_t flags = 0;
+		if (cmd == 0xFF)
+		{
+			cmd = index;
+			if (sniff->frames)
+				flags = MMC_SNIFF_EVENT_UNPAIRED;
+		}
+		else if (response == MMC_SNIFF_R1 && index != cmd)
+			flags = MMC_SNIFF_EVENT_UNPAIRED;
+
+		if (flags)
+			sniff->unpaired++;
+		else if (response == MMC_SNIFF_R1)
+		{
+			// R1 reports the state the command was received in
+			sniff->state = R1_CURRENT_STATE(arg);
+			if (g_commands[cmd].state)
+				sniff->state = g_commands[cmd].state - 1;
+		}
+		sniff->pending_cmd = 0xFF;
+		mmc_sniff_add_event(sniff, MMC_SNIFF_EVENT_RESPONSE, cmd, flags, arg);
 	}
 
-	return packet_type;
+	sniff->frames++;
+	return len;
+}
+
+void mmc_sniff_decode(mmc_sniff_t *sniff, const uint8_t *data, unsigned int len)
+{
+	unsigned int pos = 0;
+	while (pos + MMC_SNIFF_FRAME_LEN <= len && pos + mmc_sniff_frame_length(sniff, data + pos) <= len)
+		pos += mmc_sniff_frame(sniff, data + pos);
 }
@@ -19,54 +19,202 @@
 #include <string.h>
 #include <leds.h>
 #include <statuscode.h>
+#include <payload_digest.h>
 #include "erista_bct.h"
 #include "mariko_bct.h"
 #include "payload.h"
 
-enum STATUSCODE flash_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type)
+#define PAYLOAD_STAMP_MAGIC 0x504D5453 // "STMP"
+#define PAYLOAD_STAMP_VERSION 1
+
+// eMMC sessions per flash, verify or erase. A retry starts over with the clock-stuck reset:
+// whatever failed past the short one may be the boot ROM still driving the bus.
+#define PAYLOAD_MMC_ATTEMPTS 5
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t digest; // PAYLOAD_DIGEST_* of the image written
+} payload_stamp_t;
+
+// The stamp sector as it is written, zero past the stamp
+static void payload_stamp_block(enum DEVICE_TYPE cpu_type, uint8_t *block)
+{
+	payload_stamp_t stamp = {PAYLOAD_STAMP_MAGIC, PAYLOAD_STAMP_VERSION,
+		cpu_type == DEVICE_TYPE_ERISTA ? PAYLOAD_DIGEST_ERISTA : PAYLOAD_DIGEST_MARIKO};
+	memset(block, 0, 512);
+	memcpy(block, &stamp, sizeof(stamp));
+}
+
+// Whether BOOT0 holds the image of this build: the stamp, plus the first block of the first
+// BCT, which a system update rewrites without knowing about the stamp
+static uint32_t payload_stamp_check(enum DEVICE_TYPE cpu_type, int *up_to_date)
+{
+	uint8_t expected[512], tmp[512];
+	*up_to_date = 0;
+
+	payload_stamp_block(cpu_type, expected);
+	uint32_t ret = mmc_read(PAYLOAD_STAMP_SECTOR, tmp);
+	if (ret || memcmp(tmp, expected, sizeof(tmp)))
+		return ret;
+
+	ret = mmc_read(0, tmp);
+	if (ret || memcmp(tmp, cpu_type == DEVICE_TYPE_ERISTA ? erista_bct : mariko_bct, sizeof(tmp)))
+		return ret;
+
+	*up_to_date = 1;
+	return 0;
+}
+
+static uint32_t payload_stamp_write(enum DEVICE_TYPE cpu_type)
+{
+	uint8_t block[512];
+	payload_stamp_block(cpu_type, block);
+	return mmc_write(PAYLOAD_STAMP_SECTOR, block);
+}
+
+static uint32_t write_payload_blocks(enum DEVICE_TYPE cpu_type)
+{
+	uint32_t ret;
+	if (cpu_type == DEVICE_TYPE_ERISTA)
+	{
+		ret = mmc_check_and_if_different_write(0, erista_bct, sizeof(erista_bct));
+		if (ret)
+			return ret;
+		ret = mmc_check_and_if_different_write(0x20, erista_bct, sizeof(erista_bct));
+		if (ret)
+			return ret;
+	}
+	else
+	{
+		// Check and replace 1st BCT with custom one if needed.
+		ret = mmc_check_and_if_different_write(0, mariko_bct, sizeof(mariko_bct));
+		if (ret)
+			return ret;
+
+		// Check and replace 2nd BCT with custom one if needed.
+		ret = mmc_check_and_if_different_write(0x20, mariko_bct, sizeof(mariko_bct));
+		if (ret)
+			return ret;
+
+		// Check and replace 3rd BCT with official one if header is wrong.
+		ret = mmc_check_and_if_header_different_write_all(0x40, bct_mariko_1500, sizeof(bct_mariko_1500));
+		if (ret)
+			return ret;
+
+		// Check and replace 4th BCT with official one if header is wrong.
+		ret = mmc_check_and_if_header_different_write_all(0x60, bct_mariko_1500, sizeof(bct_mariko_1500));
+		if (ret)
+			return ret;
+	}
+
+	return mmc_check_and_if_different_write(0x1F80, payload, sizeof(payload));
+}
+
+// Compare the first, middle and last block of buffer at offset. differs is set on a mismatch.
+static uint32_t mmc_check_sampled(uint32_t offset, const uint8_t *buffer, uint32_t len, int *differs)
+{
+	uint8_t tmp[512];
+	uint32_t blocks = (len + sizeof(tmp) - 1) / sizeof(tmp);
+	uint32_t samples[3] = {0, blocks / 2, blocks - 1};
+
+	for (int i = 0; i < 3 && !*differs; i++)
+	{
+		uint32_t status = mmc_read(offset + samples[i], tmp);
+		if (status)
+			return status;
+
+		uint32_t size = len - samples[i] * sizeof(tmp);
+		if (size > sizeof(tmp))
+			size = sizeof(tmp);
+		if (memcmp(tmp, &buffer[samples[i] * sizeof(tmp)], size))
+			*differs = 1;
+	}
+
+	return 0;
+}
+
+static uint32_t verify_payload_blocks(enum DEVICE_TYPE cpu_type, int *differs)
+{
+	*differs = 0;
+	const uint8_t *bct = cpu_type == DEVICE_TYPE_ERISTA ? erista_bct : mariko_bct;
+	uint32_t bct_size = cpu_type == DEVICE_TYPE_ERISTA ? sizeof(erista_bct) : sizeof(mariko_bct);
+
+	uint32_t ret = mmc_check_sampled(0, bct, bct_size, differs);
+	if (!ret)
+		ret = mmc_check_sampled(0x20, bct, bct_size, differs);
+	if (!ret)
+		ret = mmc_check_sampled(0x1F80, payload, sizeof(payload), differs);
+
+	// The official BCTs are only checked by their header, as write_payload_blocks() does
+	uint8_t tmp[512];
+	for (uint32_t offset = 0x40; !ret && !*differs && cpu_type != DEVICE_TYPE_ERISTA && offset <= 0x60; offset += 0x20)
+	{
+		ret = mmc_read(offset, tmp);
+		if (!ret && memcmp(&tmp[0x10], &bct_mariko_1500[0x10], 0x100))
+			*differs = 1;
+	}
+	return ret;
+}
+
+enum STATUSCODE flash_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type, bool trust_stamp)
 {
 	leds_set_pattern(&lp_flash_payload);
 	uint32_t ret = ERR_FLASH_PAYLOAD_FAIL;
-	int retry = 6;
-	while (--retry)
+	for (int attempt = 0; attempt < PAYLOAD_MMC_ATTEMPTS; attempt++)
 	{
+		if (attempt)
+			mmc_escalate_reset();
 		ret = mmc_initialize(cid);
 		if (ret)
 			continue;
 
-		if (cpu_type == DEVICE_TYPE_ERISTA)
+		if (trust_stamp)
 		{
-			ret = mmc_check_and_if_different_write(0, erista_bct, sizeof(erista_bct));
-			if (ret)
-				continue;
-			ret = mmc_check_and_if_different_write(0x20, erista_bct, sizeof(erista_bct));
+			int up_to_date;
+			ret = payload_stamp_check(cpu_type, &up_to_date);
 			if (ret)
 				continue;
+			if (up_to_date)
+				return OK_FLASH_SUCCESS;
 		}
-		else
-		{
-			// Check and replace 1st BCT with custom one if needed.
-			ret = mmc_check_and_if_different_write(0, mariko_bct, sizeof(mariko_bct));
-			if (ret)
-				continue;
 
-			// Check and replace 2nd BCT with custom one if needed.
-			ret = mmc_check_and_if_different_write(0x20, mariko_bct, sizeof(mariko_bct));
-			if (ret)
-				continue;
+		// Only stamped once every block is known to match
+		ret = write_payload_blocks(cpu_type);
+		if (!ret)
+			ret = payload_stamp_write(cpu_type);
+		if (!ret)
+			return OK_FLASH_SUCCESS;
+	}
 
-			// Check and replace 3rd BCT with official one if header is wrong.
-			ret = mmc_check_and_if_header_different_write_all(0x40, bct_mariko_1500, sizeof(bct_mariko_1500));
-			if (ret)
-				continue;
+	if (ret && ret != OK_FLASH_SUCCESS)
+		leds_set_pattern(&lp_err_emmc);
 
-			// Check and replace 4th BCT with official one if header is wrong.
-			ret = mmc_check_and_if_header_different_write_all(0x60, bct_mariko_1500, sizeof(bct_mariko_1500));
-			if (ret)
-				continue;
-		}
+	return ret;
+}
+
+enum STATUSCODE verify_payload(uint8_t *cid, enum DEVICE_TYPE cpu_type)
+{
+	leds_set_pattern(&lp_flash_payload);
+	uint32_t ret = ERR_FLASH_PAYLOAD_FAIL;
+	for (int attempt = 0; attempt < PAYLOAD_MMC_ATTEMPTS; attempt++)
+	{
+		if (attempt)
+			mmc_escalate_reset();
+		ret = mmc_initialize(cid);
+		if (ret)
+			continue;
 
-		ret = mmc_check_and_if_different_write(0x1F80, payload, sizeof(payload));
+		// Only go through every block once a sample turned out different
+		int differs;
+		ret = verify_payload_blocks(cpu_type, &differs);
+		if (!ret && differs)
+		{
+			ret = write_payload_blocks(cpu_type);
+			if (!ret)
+				ret = payload_stamp_write(cpu_type);
+		}
 		if (!ret)
 			return OK_FLASH_SUCCESS;
 	}
@@ -81,9 +229,10 @@ enum STATUSCODE erase_payload()
 {
 	leds_set_pattern(&lp_flash_payload);
 	uint32_t ret = ERR_FLASH_PAYLOAD_FAIL;
-	int retry = 6;
-	while (--retry)
+	for (int attempt = 0; attempt < PAYLOAD_MMC_ATTEMPTS; attempt++)
 	{
+		if (attempt)
+			mmc_escalate_reset();
 		ret = mmc_initialize(0);
 		if (!ret)
 		{
@@ -94,6 +243,8 @@ enum STATUSCODE erase_payload()
 				if (!ret)
 				{
 					ret = mmc_erase(0x1F80, 0x4000);
+					if (!ret)
+						ret = mmc_erase(PAYLOAD_STAMP_SECTOR, 512);
 					if (!ret)
 						return OK_FLASH_SUCCESS;
 				}
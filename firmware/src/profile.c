@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <profile.h>
+#include <timer.h>
+#include <string.h>
+
+profile_t g_profile = {0};
+
+static const char *const g_phase_names[PROFILE_PHASE_COUNT] =
+{
+	[PROFILE_FPGA_SYNC] = "FPGA sync",
+	[PROFILE_FPGA_RESET] = "FPGA reset",
+	[PROFILE_FPGA_LINK] = "FPGA link",
+	[PROFILE_TRAINING] = "training",
+	[PROFILE_DEVICE_DETECT] = "device detect",
+	[PROFILE_ADC_WAIT] = "ADC wait",
+	[PROFILE_DEVICE_RESET] = "device reset",
+	[PROFILE_PAYLOAD_FLASH] = "payload flash",
+	[PROFILE_PAYLOAD_VERIFY] = "payload verify",
+	[PROFILE_CONFIG_SAVE] = "config save",
+	[PROFILE_GLITCH] = "glitch",
+};
+
+static const char *const g_wait_names[PROFILE_WAIT_COUNT] =
+{
+	[PROFILE_WAIT_SYNC_PULL_UP] = "PF7 pull-up",
+	[PROFILE_WAIT_SYNC_PULL_DOWN] = "PF7 pull-down",
+	[PROFILE_WAIT_FPGA_STATUS] = "FPGA status",
+};
+
+void profile_reset()
+{
+	memset(&g_profile, 0, sizeof(g_profile));
+}
+
+uint32_t profile_begin(enum PROFILE_PHASE phase)
+{
+	uint32_t now = timer_get_global_total();
+	if (g_profile.span_count < PROFILE_MAX_SPANS)
+	{
+		profile_span_t *span = &g_profile.spans[g_profile.span_count++];
+		span->phase = phase;
+		span->start_us = now;
+		span->duration_us = PROFILE_OPEN;
+	}
+	else if (g_profile.spans_dropped < 0xFF)
+		g_profile.spans_dropped++;
+	return now;
+}
+
+void profile_end(enum PROFILE_PHASE phase, uint32_t start_us)
+{
+	uint32_t duration = timer_get_global_total() - start_us;
+
+	profile_total_t *total = &g_profile.totals[phase];
+	if (total->count < 0xFFFF)
+		total->count++;
+	total->total_us += duration;
+
+	// Nested spans end first, the innermost open one of the phase is ours
+	for (int i = g_profile.span_count - 1; i >= 0; i--)
+	{
+		profile_span_t *span = &g_profile.spans[i];
+		if (span->phase == phase && span->duration_us == PROFILE_OPEN && span->start_us == start_us)
+		{
+			span->duration_us = duration;
+			break;
+		}
+	}
+}
+
+const char *profile_phase_name(enum PROFILE_PHASE phase)
+{
+	return phase < PROFILE_PHASE_COUNT ? g_phase_names[phase] : "?";
+}
+
+void profile_wait(enum PROFILE_WAIT site, bool ready, uint32_t waited_us)
+{
+	profile_wait_t *wait = &g_profile.waits[site];
+	if (wait->count < 0xFFFF)
+		wait->count++;
+	if (!ready)
+	{
+		if (wait->timeouts < 0xFFFF)
+			wait->timeouts++;
+	}
+	else if (waited_us > wait->max_us)
+		wait->max_us = waited_us;
+}
+
+const char *profile_wait_name(enum PROFILE_WAIT site)
+{
+	return site < PROFILE_WAIT_COUNT ? g_wait_names[site] : "?";
+}
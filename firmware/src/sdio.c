@@ -3,16 +3,64 @@
 #include <leds.h>
 #include <sdio.h>
 #include <statuscode.h>
+#include <string.h>
 
 void jump_bootloader_sdio_handler();
 extern int firmware_version;
 
+static void train_data_to_v2(const config_t *cfg, train_data_v2_t *out)
+{
+	memset(out, 0xFF, sizeof(train_data_v2_t));
+	out->magic = CONFIG_MAGIC;
+	out->count = cfg->count;
+	out->reflash = cfg->reflash;
+	out->boot_count = cfg->boot_count;
+
+	for (int i = 0; i < cfg->count; i++)
+	{
+		const timing_t *t = &cfg->timings[i];
+		train_timing_v2_t *o = &out->timings[i];
+		o->offset = t->offset;
+		o->width = t->width;
+		o->subcycle_delay = t->subcycle_delay;
+		o->timeout = t->timeout;
+		memcpy(o->subcycle_hits, t->subcycle_hits, sizeof(o->subcycle_hits));
+		o->success = t->success;
+	}
+}
+
+static void train_data_from_v2(config_t *cfg, const train_data_v2_t *in)
+{
+	config_clear(cfg);
+	cfg->count = in->count > CONFIG_MAX_TIMINGS ? CONFIG_MAX_TIMINGS : in->count;
+	cfg->reflash = in->reflash;
+	cfg->boot_count = in->boot_count;
+
+	for (int i = 0; i < cfg->count; i++)
+	{
+		const train_timing_v2_t *t = &in->timings[i];
+		timing_t *o = &cfg->timings[i];
+		memset(o, 0, sizeof(timing_t));
+		o->offset = t->offset;
+		o->width = t->width;
+		o->subcycle_delay = t->subcycle_delay & 3;
+		o->timeout = t->timeout;
+		memcpy(o->subcycle_hits, t->subcycle_hits, sizeof(o->subcycle_hits));
+		o->success = t->success;
+		o->last_success_boot = cfg->boot_count; // no history comes along, start out fresh
+	}
+}
+
 void sdio_handler()
 {
 	leds_set_pattern_delayed(&lp_toolbox, 3000);
 
 	while (1)
 	{
+		// Write the config learned by the glitch once the console has nothing for us
+		if (config_pending() && !(fpga_read_mmc_flags() & FPGA_MMC_BUSY_LOADER_DATA_RCVD))
+			config_commit();
+
 		fpga_pre_recv();
 
 		uint8_t buffer[512];
@@ -48,15 +96,28 @@ void sdio_handler()
 			}
 
 			case FW_DEEP_SLEEP:
+				config_commit();
 				return;
 
 			case FW_GET_TRAIN_DATA:
 			{
+				bool v2 = req->train_data.magic == TRAIN_DATA_GET_V2_MAGIC;
 				sdio_resp_t *resp = (sdio_resp_t *)buffer;
 				resp->cmd = (uint8_t)~FW_GET_TRAIN_DATA;
-				config_t cfg;
-				resp->train_data.load_result = config_load(&cfg);
-				resp->train_data.cfg = cfg;
+				const config_t *cfg = config_get();
+				resp->train_data.load_result = cfg->count ? OK_CONFIG : ERR_CONFIG_NOT_FILLED;
+				if (v2)
+				{
+					train_data_v2_t cfg_v2;
+					train_data_to_v2(cfg, &cfg_v2);
+					resp->train_data.cfg_v2 = cfg_v2;
+				}
+				else
+				{
+					config_v1_t cfg_v1;
+					config_to_v1(cfg, &cfg_v1);
+					resp->train_data.cfg = cfg_v1;
+				}
 
 				fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
 				fpga_write_buffer(buffer, sizeof(buffer));
@@ -69,9 +130,22 @@ void sdio_handler()
 				sdio_resp_t *resp = (sdio_resp_t *)buffer;
 				resp->cmd = (uint8_t)~FW_SET_TRAIN_DATA;
 
-				if (req->train_data.magic == TRAIN_DATA_SET_MAGIC)
+				uint32_t magic = req->train_data.magic;
+				if (magic == TRAIN_DATA_SET_MAGIC)
+				{
+					config_v1_t cfg_v1 = req->train_data.cfg;
+					config_t cfg;
+					config_from_v1(&cfg, &cfg_v1);
+					cfg.spi_divider = config_get()->spi_divider; // not part of the train data, belongs to this board
+					config_save(&cfg);
+					resp->train_data_ack = 0xA11600D;
+				}
+				else if (magic == TRAIN_DATA_SET_V2_MAGIC)
 				{
-					config_t cfg = req->train_data.cfg;
+					train_data_v2_t cfg_v2 = req->train_data.cfg_v2;
+					config_t cfg;
+					train_data_from_v2(&cfg, &cfg_v2);
+					cfg.spi_divider = config_get()->spi_divider;
 					config_save(&cfg);
 					resp->train_data_ack = 0xA11600D;
 				}
@@ -112,6 +186,7 @@ void sdio_handler()
 				resp->session_info.format = SESSION_INFO_FORMAT_VER;
 				resp->session_info.magic = SESSION_INFO_MAGIC;
 				resp->session_info.data = g_session_info;
+				resp->session_info.timeline = g_profile;
 
 				fpga_select_active_buffer(FPGA_BUFFER_CMD_DATA);
 				fpga_write_buffer(buffer, sizeof(buffer));
@@ -3,40 +3,44 @@
 
 static uint32_t timer_global_start;
 static uint32_t timer2_start;
-static int timer_counter = 0;
-static int timer2_counter_start = 0;
-
-void SysTick_Handler_cnt()
-{
-	if (SysTick->CTRL & (1u << 16)) // Read and Clear COUNTFLAG.
-		timer_counter++;
-}
 
 void timer_global_init()
 {
-	(void)SysTick->CTRL; // Clear COUNTFLAG.
-	timer_global_start = (0x1000000 - SysTick->VAL) / 96;
-	timer_counter = 0;
+	// Keep counting if already running, the clock stays monotonic
+	if (!(TIMER_CTL0(TIMER1) & TIMER_CTL0_CEN))
+	{
+		rcu_periph_clock_enable(RCU_TIMER1);
+		timer_deinit(TIMER1);
+		timer_parameter_struct initpara;
+		initpara.prescaler = TIMER_CYCLES_PER_US - 1;
+		initpara.alignedmode = TIMER_COUNTER_EDGE;
+		initpara.counterdirection = TIMER_COUNTER_UP;
+		initpara.clockdivision = TIMER_CKDIV_DIV1;
+		initpara.repetitioncounter = 0;
+		initpara.period = 0xFFFFFFFF; // TIMER1 is 32 bits wide
+		timer_init(TIMER1, &initpara);
+		timer_enable(TIMER1);
+
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CYCCNT = 0;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	}
+	timer_global_start = timer_global_get_us();
 }
 
 void timer2_init()
 {
-	timer2_start = (0x1000000 - SysTick->VAL) / 96;
-	timer2_counter_start = timer_counter;
+	timer2_start = timer2_get_us();
 }
 
 uint32_t timer_global_get_us()
 {
-	uint32_t us = (0x1000000 - SysTick->VAL) / 96;
-	us += (uint32_t)timer_counter * 0x2AAAA;
-	return us;
+	return TIMER_CNT(TIMER1);
 }
 
 uint32_t timer2_get_us()
 {
-	uint32_t us = (0x1000000 - SysTick->VAL) / 96;
-	us += (uint32_t)(timer_counter - timer2_counter_start) * 0x2AAAA;
-	return us;
+	return TIMER_CNT(TIMER1);
 }
 
 uint32_t timer_get_global_total()
@@ -48,3 +52,8 @@ uint32_t timer2_get_total()
 {
 	return timer2_get_us() - timer2_start;
 }
+
+uint32_t timer_cycles()
+{
+	return DWT->CYCCNT;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host tool run by the firmware build. Prints payload_digest.h with a digest of the BOOT0
+// image flash_payload() produces for every device type, which it stamps into BOOT0 once
+// written. Keep the regions in step with write_payload_blocks() in src/payload.c.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../src/erista_bct.h"
+#include "../src/mariko_bct.h"
+#include "../src/payload.h"
+
+#define BCT_HEADER_OFFSET 0x10 // only the header of the official BCTs is checked
+#define BCT_HEADER_SIZE 0x100
+
+typedef struct
+{
+	uint32_t sector;
+	const uint8_t *data;
+	uint32_t size;
+} region_t;
+
+static const region_t erista_image[] =
+{
+	{0x0000, erista_bct, sizeof(erista_bct)},
+	{0x0020, erista_bct, sizeof(erista_bct)},
+	{0x1F80, payload, sizeof(payload)},
+};
+
+static const region_t mariko_image[] =
+{
+	{0x0000, mariko_bct, sizeof(mariko_bct)},
+	{0x0020, mariko_bct, sizeof(mariko_bct)},
+	{0x0040, bct_mariko_1500 + BCT_HEADER_OFFSET, BCT_HEADER_SIZE},
+	{0x0060, bct_mariko_1500 + BCT_HEADER_OFFSET, BCT_HEADER_SIZE},
+	{0x1F80, payload, sizeof(payload)},
+};
+
+// 64-bit FNV-1a
+static uint64_t digest_bytes(uint64_t hash, const uint8_t *data, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static uint64_t digest_u32(uint64_t hash, uint32_t value)
+{
+	uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+	return digest_bytes(hash, bytes, sizeof(bytes));
+}
+
+// Where every region goes is part of the digest, not only what is written
+static uint64_t digest_image(const region_t *regions, unsigned int count)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		hash = digest_u32(hash, regions[i].sector);
+		hash = digest_u32(hash, regions[i].size);
+		hash = digest_bytes(hash, regions[i].data, regions[i].size);
+	}
+	return hash;
+}
+
+int main()
+{
+	printf("// Generated by tools/payload_digest.c, do not edit\n");
+	printf("#ifndef __PAYLOAD_DIGEST_H__\n");
+	printf("#define __PAYLOAD_DIGEST_H__\n\n");
+	printf("#define PAYLOAD_DIGEST_ERISTA 0x%016llXull\n",
+		(unsigned long long)digest_image(erista_image, sizeof(erista_image) / sizeof(erista_image[0])));
+	printf("#define PAYLOAD_DIGEST_MARIKO 0x%016llXull\n",
+		(unsigned long long)digest_image(mariko_image, sizeof(mariko_image) / sizeof(mariko_image[0])));
+	printf("\n#endif\n");
+	return 0;
+}
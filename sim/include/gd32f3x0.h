@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for the GD32F3x0 device header. Only covers what the firmware
+// modules compiled into the simulator actually touch.
+
+#ifndef __SIM_GD32F3X0_H__
+#define __SIM_GD32F3X0_H__
+
+#include <stdint.h>
+
+typedef enum
+{
+	FMC_READY,
+	FMC_BUSY,
+	FMC_PGERR,
+	FMC_WPERR,
+	FMC_TOERR,
+} fmc_state_enum;
+
+#define FMC_FLAG_BUSY	0x01
+#define FMC_FLAG_PGERR	0x04
+#define FMC_FLAG_WPERR	0x10
+#define FMC_FLAG_END	0x20
+
+void fmc_unlock(void);
+void fmc_lock(void);
+void fmc_flag_clear(uint32_t flag);
+fmc_state_enum fmc_page_erase(uint32_t page_address);
+fmc_state_enum fmc_word_program(uint32_t address, uint32_t data);
+
+#endif
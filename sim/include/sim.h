@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <device.h>
+#include <fpga.h>
+#include <glitch.h>
+
+// Virtual wall clock of the simulated modchip, in nanoseconds since power-on.
+extern uint64_t sim_now_ns;
+#define SIM_US(x) ((uint64_t)(x) * 1000ull)
+#define SIM_MS(x) ((uint64_t)(x) * 1000000ull)
+
+static inline void sim_advance(uint64_t ns)
+{
+	sim_now_ns += ns;
+}
+
+// Deterministic PRNG; every simulated power cycle is reseeded from (seed, unit, boot).
+void sim_rand_seed(uint64_t seed);
+uint64_t sim_rand_u64();
+double sim_rand_double(); // [0, 1)
+double sim_rand_normal();
+
+// Console model: success-probability surface over (offset, width, subcycle_delay)
+// plus the outcome classes the eMMC sniffer would observe when the pulse misses.
+typedef struct
+{
+	enum DEVICE_TYPE device_type;
+	double offset0;       // sweet spot, in eMMC clock cycles
+	double width0;        // sweet spot, in 48MHz pulse width cycles
+	double sigma_offset;  // spread of the sweet spot along offset + subcycle_delay / 4
+	double sigma_width;   // spread of the sweet spot along width
+	double peak;          // success probability at the sweet spot
+	double hang_scale;    // width scale of the logistic "CPU hang" vs "no effect" split
+	double no_comms;      // probability that a miss leaves the eMMC bus silent
+	double depth_signal;  // fraction of block-read misses that read more the closer the offset is to the sweet spot
+	double mmc_stuck;     // fraction of units whose eMMC only answers the modchip after a clock-stuck reset
+	int mmc_short_reset_fails; // drawn per unit from mmc_stuck
+} sim_console_t;
+
+extern sim_console_t sim_console;
+
+double sim_console_success_probability(const glitch_cfg_t *cfg);
+enum GLITCH_RESULT_TYPE sim_console_draw_outcome(const glitch_cfg_t *cfg);
+unsigned int sim_console_draw_block_reads(const glitch_cfg_t *cfg);
+
+// Per power-cycle counters, filled by the hardware stand-ins.
+typedef struct
+{
+	uint32_t attempts;
+	uint32_t spi_transactions;
+	uint32_t spi_polls; // part of spi_transactions spent waiting for a flag
+	uint32_t spi_buffer_bytes; // moved by buffer reads and writes
+	uint32_t flash_erases;
+	uint32_t flash_words;
+	uint32_t mmc_initializes; // GO_IDLE_STATE sent by mmc_initialize()
+	uint32_t mmc_commands;
+	uint32_t mmc_blocks_read;
+	uint32_t mmc_blocks_written;
+	uint32_t mmc_blocks_trimmed;
+	uint32_t lost_successes; // successes flagged as timeouts because the window was too short
+	uint64_t first_success_ns;
+	uint32_t first_success_attempts;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+// Flash region of the modchip MCU that holds the timing configuration.
+void sim_flash_init();
+void sim_flash_erase_all();
+
+// eMMC behind the FPGA's command engine; BOOT0 is shared between all power cycles of one unit.
+void sim_mmc_init();
+void sim_mmc_erase_all(uint64_t seed);
+void sim_mmc_power_cycle(int clock_stuck);
+void sim_mmc_set_trim(int supported); // EXT_CSD reports TRIM, the default
+uint8_t *sim_mmc_sector(uint32_t sector);
+// Runs the descriptor in frame, leaving the response in response and moving a data block
+// through data; returns how long the bus is busy with it, SIM_MMC_NO_RESPONSE if forever
+#define SIM_MMC_NO_RESPONSE UINT64_MAX
+uint64_t sim_mmc_execute(const uint8_t *frame, uint8_t *response, uint8_t *data);
+int sim_mmc_check(enum DEVICE_TYPE device_type);
+
+// Firmware's eMMC capture decoder on hex dumps from the debug log
+int sim_sniff_print(const char *hex);
+int sim_sniff_check();
+
+#endif
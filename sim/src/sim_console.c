@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sim.h>
+#include <math.h>
+
+sim_console_t sim_console;
+
+static uint64_t g_rand_state;
+
+void sim_rand_seed(uint64_t seed)
+{
+	g_rand_state = seed;
+}
+
+uint64_t sim_rand_u64()
+{
+	// splitmix64
+	uint64_t z = (g_rand_state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+double sim_rand_double()
+{
+	return (sim_rand_u64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double sim_rand_normal()
+{
+	double u1 = sim_rand_double();
+	double u2 = sim_rand_double();
+	return sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2);
+}
+
+double sim_console_success_probability(const glitch_cfg_t *cfg)
+{
+	// subcycle_delay adds pulses at 4x the eMMC clock after 'offset'
+	double delay = cfg->offset + cfg->subcycle_delay / 4.0;
+	double d = (delay - sim_console.offset0) / sim_console.sigma_offset;
+	double w = (cfg->width - sim_console.width0) / sim_console.sigma_width;
+	return sim_console.peak * exp(-0.5 * (d * d + w * w));
+}
+
+enum GLITCH_RESULT_TYPE sim_console_draw_outcome(const glitch_cfg_t *cfg)
+{
+	if (sim_rand_double() < sim_console_success_probability(cfg))
+		return GLITCH_RESULT_SUCCESS;
+
+	if (sim_rand_double() < sim_console.no_comms)
+		return GLITCH_RESULT_FAIL_NO_EMMC_COMMS;
+
+	// Pulses longer than the sweet spot tend to hang the CPU; shorter ones have
+	// no observable effect and the boot ROM carries on reading the BCT.
+	double hang = 1.0 / (1.0 + exp(-(cfg->width - sim_console.width0) / sim_console.hang_scale));
+	return sim_rand_double() < hang ? GLITCH_RESULT_FAIL_TIMEOUT : GLITCH_RESULT_FAILED_MMC;
+}
+
+unsigned int sim_console_draw_block_reads(const glitch_cfg_t *cfg)
+{
+	// Without a depth signal the boot ROM gets 1..8 blocks in regardless of the timing.
+	// With it, part of the misses read more blocks the closer the pulse is to the sweet
+	// spot along offset, over eight times its spread so that it reaches the window edges.
+	unsigned int reads = 1 + sim_rand_u64() % 8;
+	if (sim_console.depth_signal > 0 && sim_rand_double() < sim_console.depth_signal)
+	{
+		double d = (cfg->offset + cfg->subcycle_delay / 4.0 - sim_console.offset0) / (8 * sim_console.sigma_offset);
+		reads = 1 + (unsigned int)(7 * exp(-0.5 * d * d) + sim_rand_double());
+	}
+	return reads;
+}
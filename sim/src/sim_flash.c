@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gd32f3x0.h>
+#include <sim.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// config.c reads the timing table straight from its flash address, so map the
+// MCU's flash at the very same address. The mapping is shared so that forked
+// power cycles of one unit see what earlier ones programmed.
+#define SIM_FLASH_BASE 0x8000000
+#define SIM_FLASH_SIZE 0x20000
+#define SIM_FLASH_PAGE_SIZE 0x400
+
+// GD32F350 datasheet order of magnitude; dominates the cost of config_save().
+#define SIM_FLASH_PAGE_ERASE_US 50000
+#define SIM_FLASH_WORD_PROGRAM_US 40
+
+static int g_fmc_locked = 1;
+
+void sim_flash_init()
+{
+	void *flash = mmap((void *)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (flash != (void *)SIM_FLASH_BASE)
+	{
+		fprintf(stderr, "sim: unable to map flash at 0x%08X\n", SIM_FLASH_BASE);
+		exit(1);
+	}
+	sim_flash_erase_all();
+}
+
+void sim_flash_erase_all()
+{
+	memset((void *)SIM_FLASH_BASE, 0xFF, SIM_FLASH_SIZE);
+}
+
+static int sim_flash_valid(uint32_t address)
+{
+	return address >= SIM_FLASH_BASE && address < SIM_FLASH_BASE + SIM_FLASH_SIZE;
+}
+
+void fmc_unlock(void)
+{
+	g_fmc_locked = 0;
+}
+
+void fmc_lock(void)
+{
+	g_fmc_locked = 1;
+}
+
+void fmc_flag_clear(uint32_t flag)
+{
+}
+
+fmc_state_enum fmc_page_erase(uint32_t page_address)
+{
+	if (g_fmc_locked || !sim_flash_valid(page_address))
+		return FMC_WPERR;
+
+	page_address &= ~(SIM_FLASH_PAGE_SIZE - 1);
+	memset((void *)(uintptr_t)page_address, 0xFF, SIM_FLASH_PAGE_SIZE);
+	sim_stats.flash_erases++;
+	sim_advance(SIM_US(SIM_FLASH_PAGE_ERASE_US));
+	return FMC_READY;
+}
+
+fmc_state_enum fmc_word_program(uint32_t address, uint32_t data)
+{
+	if (g_fmc_locked || !sim_flash_valid(address) || (address & 3))
+		return FMC_WPERR;
+
+	// Programming is only possible onto erased words.
+	uint32_t *word = (uint32_t *)(uintptr_t)address;
+	if (*word != 0xFFFFFFFF)
+		return FMC_PGERR;
+
+	*word = data;
+	sim_stats.flash_words++;
+	sim_advance(SIM_US(SIM_FLASH_WORD_PROGRAM_US));
+	return FMC_READY;
+}
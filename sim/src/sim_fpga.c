@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stand-ins for the FPGA link. Each glitch attempt draws its outcome from the
+// console model and schedules when the FPGA would raise SUCCESS or TIMEOUT;
+// flag polling fast-forwards the virtual clock instead of spinning. eMMC commands
+// go to the card model in sim_mmc.c.
+
+#include <sim.h>
+#include <fpga.h>
+#include <string.h>
+#include "mmc_defs.h"
+
+int fpga_sync_failed = 0;
+int payload_not_yet_flashed = 1;
+
+// Cost model of the polled SPI0 link at the prescaler used after fpga_reset().
+#define SIM_SPI_TRANSACTION_NS 3000 // CS-framed register access incl. polling overhead
+#define SIM_SPI_BYTE_NS 750
+#define SIM_SPI_DMA_SETUP_NS 2000 // channel programming for a DMA buffer transfer
+#define SIM_SPI_DMA_BYTE_NS 340 // back-to-back bytes at the SCK rate
+#define SIM_SPI_POLL_NS (SIM_SPI_TRANSACTION_NS + 3 * SIM_SPI_BYTE_NS) // one 0x26 register read
+#define SIM_EVENT_WAKE_NS 2000 // EXTI entry and return from WFI, with FPGA_EVENT_IRQ
+
+#define SIM_GLITCH_ARM_DELAY_MS 1 // delay_ms(1) in fpga_glitch_device()
+#define SIM_BOOT_TO_TRIGGER_US 20000 // console reset release until the sector 0x13 read
+#define SIM_TIMEOUT_UNIT_US 1200 // one unit of glitch_cfg_t.timeout
+#define SIM_SUCCESS_FLAG_MIN_US 1500 // pulse until the boot ROM reads the payload
+#define SIM_SUCCESS_FLAG_MAX_US 4000
+#define SIM_MMC_FIRST_MIN_US 300 // silence after a miss until the boot ROM's next command
+#define SIM_MMC_FIRST_MAX_US 2500
+#define SIM_MMC_TRAFFIC_MIN_US 2000 // BCT reads the boot ROM keeps doing after a miss
+#define SIM_MMC_TRAFFIC_MAX_US 10000
+#define SIM_CONFIRM_US 250000 // payload start until its first command on the bus
+
+static struct
+{
+	enum GLITCH_RESULT_TYPE outcome;
+	uint64_t done_ns;
+	uint64_t confirm_ns;
+	int cmd_mode;
+	int mmc_mode; // the command engine has been used since the last attempt
+	uint64_t mmc_done_ns;
+	uint8_t datalen;
+	uint8_t resp_data[512];
+} g_attempt;
+
+static enum FPGA_BUFFER g_active_buffer;
+static uint8_t g_cmd_buffer[32]; // command frame, overwritten by the response
+static uint8_t g_data_buffer[512];
+
+static void sim_spi_transaction(unsigned int bytes)
+{
+	sim_stats.spi_transactions++;
+	sim_advance(SIM_SPI_TRANSACTION_NS + (uint64_t)bytes * SIM_SPI_BYTE_NS);
+}
+
+static void sim_spi_buffer_transaction(unsigned int size)
+{
+	sim_stats.spi_buffer_bytes += size;
+#if FPGA_SPI_DMA
+	if (size >= FPGA_SPI_DMA_MIN_LEN)
+	{
+		sim_stats.spi_transactions++;
+		sim_advance(SIM_SPI_TRANSACTION_NS + SIM_SPI_BYTE_NS + SIM_SPI_DMA_SETUP_NS + (uint64_t)size * SIM_SPI_DMA_BYTE_NS);
+		return;
+	}
+#endif
+	sim_spi_transaction(1 + size);
+}
+
+static uint8_t sim_crc7(const uint8_t *buffer, int size)
+{
+	uint8_t crc = 0;
+	for (int i = 0; i < size; i++)
+	{
+		uint8_t c = buffer[i];
+		for (int j = 0; j < 8; j++)
+		{
+			crc <<= 1;
+			if ((crc ^ c) & 0x80)
+				crc ^= 9;
+			c <<= 1;
+		}
+		crc &= 0x7F;
+	}
+	return crc;
+}
+
+static void sim_capture_frame(uint8_t first, uint32_t arg)
+{
+	if (g_attempt.datalen > 0xFF - 6)
+		return;
+
+	uint8_t *frame = &g_attempt.resp_data[g_attempt.datalen];
+	frame[0] = first;
+	frame[1] = arg >> 24;
+	frame[2] = arg >> 16;
+	frame[3] = arg >> 8;
+	frame[4] = arg;
+	frame[5] = (sim_crc7(frame, 5) << 1) | 1;
+	g_attempt.datalen += 6;
+}
+
+static void sim_capture_block_read(uint32_t sector)
+{
+	sim_capture_frame(0x40 | MMC_READ_SINGLE_BLOCK, sector);
+	sim_capture_frame(MMC_READ_SINGLE_BLOCK, (R1_STATE_TRAN << 9) | R1_READY_FOR_DATA);
+}
+
+void fpga_select_active_buffer(enum FPGA_BUFFER buffer)
+{
+	g_active_buffer = buffer;
+	if (fpga_shadow_write(FPGA_REG_BUFFER_SELECT, buffer))
+		sim_spi_transaction(3);
+}
+
+void fpga_reset_device(int do_clock_stuck_glitch)
+{
+	sim_mmc_power_cycle(do_clock_stuck_glitch == 1);
+	sim_spi_transaction(3);
+	sim_advance(SIM_MS(2));
+	sim_spi_transaction(3);
+	if (do_clock_stuck_glitch == 1)
+		sim_advance(SIM_MS(15 + 2000 + 1));
+}
+
+void fpga_glitch_device(glitch_cfg_t *cfg)
+{
+	// Same frames as fpga.c: stop, changed registers and device reset, then release after the delay
+	unsigned int reg_bytes[4], frames = 0;
+	if (fpga_shadow_write(FPGA_REG_GLITCH_OFFSET, cfg->offset))
+		reg_bytes[frames++] = 4;
+	if (fpga_shadow_write(FPGA_REG_GLITCH_WIDTH, cfg->width))
+		reg_bytes[frames++] = 3;
+	if (fpga_shadow_write(FPGA_REG_GLITCH_TIMEOUT, cfg->timeout))
+		reg_bytes[frames++] = 3;
+	if (fpga_shadow_write(FPGA_REG_SUBCYCLE_DELAY, cfg->subcycle_delay))
+		reg_bytes[frames++] = 3;
+#if FPGA_SPI_BURST
+	unsigned int bytes = 2 * 3;
+	for (unsigned int i = 0; i < frames; i++)
+		bytes += reg_bytes[i];
+	sim_spi_transaction(bytes);
+#else
+	sim_spi_transaction(3);
+	for (unsigned int i = 0; i < frames; i++)
+		sim_spi_transaction(reg_bytes[i]);
+	sim_spi_transaction(3);
+#endif
+	sim_advance(SIM_MS(SIM_GLITCH_ARM_DELAY_MS));
+	sim_spi_transaction(3);
+
+	sim_stats.attempts++;
+	memset(&g_attempt, 0, sizeof(g_attempt));
+	g_attempt.outcome = sim_console_draw_outcome(cfg);
+
+	uint64_t pulse_ns = sim_now_ns + SIM_US(SIM_BOOT_TO_TRIGGER_US);
+	uint64_t window_ns = SIM_US((uint64_t)cfg->timeout * SIM_TIMEOUT_UNIT_US);
+
+	// A window shorter than the silence after the pulse flags a timeout before the
+	// boot ROM is heard from again; the attempt then looks like a hang.
+	uint64_t silence_us = 0;
+	if (g_attempt.outcome == GLITCH_RESULT_SUCCESS)
+		silence_us = SIM_SUCCESS_FLAG_MIN_US + sim_rand_u64() % (SIM_SUCCESS_FLAG_MAX_US - SIM_SUCCESS_FLAG_MIN_US);
+	else if (g_attempt.outcome == GLITCH_RESULT_FAILED_MMC)
+		silence_us = SIM_MMC_FIRST_MIN_US + sim_rand_u64() % (SIM_MMC_FIRST_MAX_US - SIM_MMC_FIRST_MIN_US);
+	if (SIM_US(silence_us) > window_ns)
+	{
+		if (g_attempt.outcome == GLITCH_RESULT_SUCCESS)
+			sim_stats.lost_successes++;
+		g_attempt.outcome = GLITCH_RESULT_FAIL_TIMEOUT;
+	}
+
+	switch (g_attempt.outcome)
+	{
+		case GLITCH_RESULT_SUCCESS:
+			g_attempt.done_ns = pulse_ns + SIM_US(silence_us);
+			g_attempt.confirm_ns = g_attempt.done_ns + SIM_US(SIM_CONFIRM_US);
+			for (uint32_t sector = 0x1F80; sector < 0x1F84; sector++)
+				sim_capture_block_read(sector);
+			break;
+
+		case GLITCH_RESULT_FAILED_MMC:
+		{
+			uint64_t traffic_us = SIM_MMC_TRAFFIC_MIN_US + sim_rand_u64() % (SIM_MMC_TRAFFIC_MAX_US - SIM_MMC_TRAFFIC_MIN_US);
+			g_attempt.done_ns = pulse_ns + SIM_US(traffic_us) + window_ns;
+			sim_capture_frame(MMC_READ_SINGLE_BLOCK, (R1_STATE_TRAN << 9) | R1_READY_FOR_DATA);
+			unsigned int reads = sim_console_draw_block_reads(cfg);
+			for (uint32_t sector = 0x14; sector < 0x14 + reads; sector++)
+				sim_capture_block_read(sector);
+			break;
+		}
+
+		case GLITCH_RESULT_FAIL_TIMEOUT:
+			// CPU hung right after the pulse; only the pending response is seen.
+			g_attempt.done_ns = pulse_ns + window_ns;
+			sim_capture_frame(MMC_READ_SINGLE_BLOCK, (R1_STATE_TRAN << 9) | R1_READY_FOR_DATA);
+			break;
+
+		default:
+			g_attempt.done_ns = pulse_ns + window_ns;
+			g_attempt.datalen = sim_rand_u64() % 5;
+			break;
+	}
+}
+
+uint8_t fpga_read_glitch_flags()
+{
+	sim_spi_transaction(3);
+	return 0;
+}
+
+static uint64_t sim_event_ns()
+{
+	if (g_attempt.mmc_mode)
+		return g_attempt.mmc_done_ns;
+	return g_attempt.cmd_mode ? g_attempt.confirm_ns : g_attempt.done_ns;
+}
+
+// Flags at the current virtual time
+static uint8_t sim_mmc_flags()
+{
+	if (g_attempt.mmc_mode)
+		return sim_now_ns < g_attempt.mmc_done_ns ? FPGA_MMC_BUSY_SENDING : 0;
+
+	if (sim_now_ns < sim_event_ns())
+		return 0;
+
+	if (g_attempt.cmd_mode)
+		return FPGA_MMC_BUSY_LOADER_DATA_RCVD;
+
+	uint8_t flags = g_attempt.outcome == GLITCH_RESULT_SUCCESS ? FPGA_MMC_GLITCH_SUCCESS : FPGA_MMC_GLITCH_TIMEOUT;
+	if (g_attempt.datalen)
+		flags |= FPGA_MMC_GLITCH_DT_CAPTURED;
+	return flags;
+}
+
+// A flag read by a poll loop that gives up at deadline_ns
+static uint8_t sim_poll_mmc_flags(uint64_t deadline_ns)
+{
+	sim_spi_transaction(3);
+
+	uint64_t event_ns = sim_event_ns();
+	if (sim_now_ns < event_ns)
+	{
+		// Skip the poll loop ahead to the event, accounting the SPI traffic it would generate.
+		uint64_t until_ns = event_ns < deadline_ns ? event_ns : deadline_ns;
+		if (sim_now_ns < until_ns)
+		{
+			uint64_t polls = (until_ns - sim_now_ns) / SIM_SPI_POLL_NS;
+			sim_stats.spi_transactions += polls;
+			sim_stats.spi_polls += polls;
+			sim_now_ns = until_ns;
+		}
+		return g_attempt.mmc_mode ? FPGA_MMC_BUSY_SENDING : 0;
+	}
+
+	return sim_mmc_flags();
+}
+
+uint8_t fpga_read_mmc_flags()
+{
+	return sim_poll_mmc_flags(UINT64_MAX);
+}
+
+static int sim_event_done(enum FPGA_EVENT event, uint8_t flags)
+{
+	switch (event)
+	{
+		case FPGA_EVENT_GLITCH_DONE:
+			return flags & (FPGA_MMC_GLITCH_SUCCESS | FPGA_MMC_GLITCH_TIMEOUT);
+		case FPGA_EVENT_MMC_CMD_DONE:
+			return !(flags & FPGA_MMC_BUSY_SENDING);
+		default:
+			return flags & FPGA_MMC_BUSY_LOADER_DATA_RCVD;
+	}
+}
+
+// The simulated status line announces every event, so waits sleep on it once the
+// firmware would trust it.
+unsigned int fpga_wait_event(enum FPGA_EVENT event, uint32_t timeout_us, uint8_t *flags)
+{
+#if FPGA_EVENT_IRQ
+	static uint8_t votes;
+#endif
+	unsigned int reads = 0;
+	uint64_t deadline_ns = timeout_us ? sim_now_ns + SIM_US(timeout_us) : UINT64_MAX;
+
+	for (;;)
+	{
+#if FPGA_EVENT_IRQ
+		if (votes >= FPGA_EVENT_VOTES)
+		{
+			// A single read, then asleep until the line fires
+			if (reads)
+			{
+				uint64_t wake_ns = sim_event_ns() < deadline_ns ? sim_event_ns() : deadline_ns;
+				if (sim_now_ns < wake_ns)
+					sim_now_ns = wake_ns;
+				sim_advance(SIM_EVENT_WAKE_NS);
+			}
+			sim_spi_transaction(3);
+			*flags = sim_mmc_flags();
+		}
+		else
+#endif
+			*flags = sim_poll_mmc_flags(deadline_ns);
+
+		if (sim_event_done(event, *flags))
+			break;
+		if (sim_now_ns >= deadline_ns)
+		{
+#if FPGA_EVENT_IRQ
+			// An event that never came says nothing for the line
+			if (reads)
+				votes = 0;
+#endif
+			return reads;
+		}
+		reads++;
+	}
+
+#if FPGA_EVENT_IRQ
+	if (reads && votes < 0xFF)
+		votes++;
+#endif
+	return reads;
+}
+
+uint32_t fpga_read_type()
+{
+	sim_spi_transaction(5);
+	return 0x4C465748; // "HWFL"
+}
+
+static uint32_t g_read_pos; // next byte of the active buffer within a read frame
+
+void fpga_read_buffer_begin()
+{
+	sim_spi_transaction(1);
+	g_read_pos = 0;
+}
+
+void fpga_read_buffer_next(uint8_t *buffer, uint32_t size)
+{
+	sim_stats.spi_buffer_bytes += size;
+#if FPGA_SPI_DMA
+	if (size >= FPGA_SPI_DMA_MIN_LEN)
+		sim_advance(SIM_SPI_DMA_SETUP_NS + (uint64_t)size * SIM_SPI_DMA_BYTE_NS);
+	else
+#endif
+		sim_advance((uint64_t)size * SIM_SPI_BYTE_NS);
+
+	for (uint32_t i = 0; i < size; i++, g_read_pos++)
+	{
+		uint8_t value = 0;
+		if (g_attempt.mmc_mode)
+		{
+			if (g_active_buffer == FPGA_BUFFER_CMD && g_read_pos < sizeof(g_cmd_buffer))
+				value = g_cmd_buffer[g_read_pos];
+			else if (g_active_buffer == FPGA_BUFFER_CMD_DATA && g_read_pos < sizeof(g_data_buffer))
+				value = g_data_buffer[g_read_pos];
+		}
+		else if (g_active_buffer == FPGA_BUFFER_CMD && g_read_pos == FPGA_CAPTURE_LEN_OFFSET)
+			value = g_attempt.datalen;
+		else if (g_active_buffer == FPGA_BUFFER_RESP_DATA && g_read_pos < sizeof(g_attempt.resp_data))
+			value = g_attempt.resp_data[g_read_pos];
+		buffer[i] = value;
+	}
+}
+
+void fpga_read_buffer_end()
+{
+}
+
+void fpga_read_buffer(uint8_t *buffer, uint32_t size)
+{
+	fpga_read_buffer_begin();
+	fpga_read_buffer_next(buffer, size);
+	fpga_read_buffer_end();
+}
+
+void fpga_write_buffer(uint8_t *buffer, uint32_t size)
+{
+	sim_spi_buffer_transaction(size);
+	if (g_active_buffer == FPGA_BUFFER_CMD)
+		memcpy(g_cmd_buffer, buffer, size < sizeof(g_cmd_buffer) ? size : sizeof(g_cmd_buffer));
+	else if (g_active_buffer == FPGA_BUFFER_CMD_DATA)
+		memcpy(g_data_buffer, buffer, size < sizeof(g_data_buffer) ? size : sizeof(g_data_buffer));
+}
+
+void fpga_do_mmc_command()
+{
+	sim_spi_transaction(1);
+	g_attempt.mmc_mode = 1;
+	uint64_t busy_ns = sim_mmc_execute(g_cmd_buffer, g_cmd_buffer, g_data_buffer);
+	g_attempt.mmc_done_ns = busy_ns == SIM_MMC_NO_RESPONSE ? SIM_MMC_NO_RESPONSE : sim_now_ns + busy_ns;
+}
+
+void fpga_enter_cmd_mode()
+{
+	sim_spi_transaction(3);
+	sim_spi_transaction(3);
+	g_attempt.cmd_mode = 1;
+}
+
+void fpga_post_recv()
+{
+	sim_spi_transaction(3);
+}
+
+void fpga_post_send()
+{
+	sim_spi_transaction(3);
+}
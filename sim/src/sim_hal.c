@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stand-ins for the ADC, timers, delays, LEDs and board detection used by the
+// glitch engine and the eMMC payload programming.
+
+#include <sim.h>
+#include <adc.h>
+#include <board_id.h>
+#include <delay.h>
+#include <leds.h>
+#include <statuscode.h>
+#include <timer.h>
+
+#define SIM_ADC_CONVERSION_US 20
+#define SIM_POWER_ON_US 40000 // console rail ramp after a reset until the glitch threshold
+#define SIM_DETECT_DEVICE_US 3000
+
+uint16_t adc_wait_eoc_read()
+{
+	sim_advance(SIM_US(SIM_ADC_CONVERSION_US));
+	return 0xFFF;
+}
+
+int init_device_specific_adc(enum DEVICE_TYPE dt, struct adc_param *pap)
+{
+	if (dt == DEVICE_TYPE_ERISTA)
+	{
+		pap->poweron_threshold = 1200;
+		pap->glitch_threshold = 1376;
+		return 0;
+	}
+	if (dt == DEVICE_TYPE_MARIKO || dt == DEVICE_TYPE_LITE)
+	{
+		pap->poweron_threshold = 1024;
+		pap->glitch_threshold = dt == DEVICE_TYPE_MARIKO ? 1296 : 1270;
+		return 0;
+	}
+	return ERR_UNKNOWN_DEVICE;
+}
+
+int adc_wait_for_min_value(logger *lgr, unsigned int min_adc_value, uint16_t *adc_read_out)
+{
+	fpga_reset_device(0);
+	sim_advance(SIM_US(SIM_POWER_ON_US));
+	uint16_t adc_read = adc_wait_eoc_read();
+	if (adc_read_out)
+		*adc_read_out = adc_read;
+	lgr->adc(adc_read | 0x10000000);
+	return 0;
+}
+
+enum DEVICE_TYPE detect_device_type()
+{
+	fpga_reset_device(0);
+	sim_advance(SIM_US(SIM_DETECT_DEVICE_US));
+	return sim_console.device_type;
+}
+
+enum BOARD_ID board_id_get()
+{
+	return sim_console.device_type == DEVICE_TYPE_LITE ? BOARD_ID_LITE : BOARD_ID_CORE;
+}
+
+void delay_ms(uint32_t nms)
+{
+	sim_advance(SIM_MS(nms));
+}
+
+void delay_us(uint32_t nus)
+{
+	sim_advance(SIM_US(nus));
+}
+
+static uint64_t g_timer2_start_ns;
+
+void timer_global_init()
+{
+}
+
+void timer2_init()
+{
+	g_timer2_start_ns = sim_now_ns;
+}
+
+uint32_t timer_global_get_us()
+{
+	return sim_now_ns / 1000;
+}
+
+uint32_t timer2_get_us()
+{
+	return sim_now_ns / 1000;
+}
+
+uint32_t timer_get_global_total()
+{
+	return sim_now_ns / 1000;
+}
+
+uint32_t timer2_get_total()
+{
+	return (sim_now_ns - g_timer2_start_ns) / 1000;
+}
+
+uint32_t timer_cycles()
+{
+	return sim_now_ns * TIMER_CYCLES_PER_US / 1000;
+}
+
+led_pattern_t lp_glitch_prepare;
+led_pattern_t lp_glitch_glitching;
+led_pattern_t lp_glitch_done;
+led_pattern_t lp_train_prepare;
+led_pattern_t lp_train_glitching;
+led_pattern_t lp_train_done;
+led_pattern_t lp_usb;
+led_pattern_t lp_toolbox;
+led_pattern_t lp_fw_write;
+led_pattern_t lp_fw_read;
+led_pattern_t lp_flash_payload;
+led_pattern_t lp_err_emmc;
+led_pattern_t lp_err_exhausted;
+led_pattern_t lp_err_adc;
+led_pattern_t lp_err_fpga;
+led_pattern_t lp_err_glitch;
+led_pattern_t lp_err_firmware;
+led_pattern_t lp_err_unknown;
+led_pattern_t lp_config_reset;
+led_pattern_t lp_off;
+
+static led_pattern_t g_led_state;
+
+led_pattern_t leds_get_pattern()
+{
+	return g_led_state;
+}
+
+void leds_set_pattern(const led_pattern_t *pattern)
+{
+	g_led_state = *pattern;
+}
+
+void leds_set_pattern_delayed(const led_pattern_t *pattern, int delay_ms)
+{
+}
+
+void leds_override(uint32_t duration_ms, const led_pattern_t *pattern)
+{
+}
@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host-side simulator of the glitch engine. Runs the unmodified glitch.c,
+// glitch_heuristic.c, mmc_sniffer.c, config.c, mmc.c and payload.c against a
+// modelled console and reports attempts and simulated wall-clock until
+// OK_GLITCH_SUCCESS for cold-start training and for warm boots over many seeded units.
+//
+// Every power cycle of the modchip runs in a forked child so that file-static
+// firmware state starts out fresh, while the flash and BOOT0 mappings are shared
+// between all power cycles of one unit.
+
+#include <sim.h>
+#include <config.h>
+#include <glitch.h>
+#include <logger.h>
+#include <profile.h>
+#include <session_info.h>
+#include <statuscode.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+uint64_t sim_now_ns;
+sim_stats_t sim_stats;
+
+typedef struct
+{
+	uint32_t ok;
+	uint32_t attempts;
+	uint64_t ns;
+	uint32_t flash_erases;
+	uint32_t spi_transactions;
+	uint32_t spi_polls;
+	uint32_t spi_buffer_bytes;
+	uint32_t mmc_initializes;
+	uint32_t lost_successes;
+	uint32_t phase_us[PROFILE_PHASE_COUNT]; // from the boot timeline
+} sim_result_t;
+
+typedef struct
+{
+	sim_result_t first; // cold start until the first OK_GLITCH_SUCCESS
+	sim_result_t training; // whole training session
+	uint32_t payload_program_us; // flash_payload() at the start of training, from session_info_t
+	uint32_t training_successes;
+} sim_unit_result_t;
+
+static struct
+{
+	unsigned int units;
+	unsigned int boots;
+	unsigned int trains;
+	unsigned int max_train_attempts;
+	uint64_t seed;
+	enum DEVICE_TYPE device_type;
+	double width_min, width_max;
+	sim_console_t console;
+	int verbose;
+	int mmc_check;
+} g_opt =
+{
+	.units = 1000,
+	.boots = 10,
+	.trains = 0,
+	.max_train_attempts = 50000,
+	.seed = 1,
+	.device_type = DEVICE_TYPE_MARIKO,
+	.width_min = 25,
+	.width_max = 60,
+	.console =
+	{
+		.sigma_offset = 3.0,
+		.sigma_width = 2.5,
+		.peak = 0.35,
+		.hang_scale = 2.0,
+		.no_comms = 0.002,
+	},
+};
+
+static void sim_power_on(unsigned int unit, unsigned int boot)
+{
+	sim_rand_seed(g_opt.seed * 0x100000001B3ull ^ ((uint64_t)unit << 20) ^ boot);
+	sim_now_ns = 0;
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	profile_reset();
+}
+
+static void sim_result_fill(sim_result_t *res, uint32_t ok)
+{
+	res->ok = ok;
+	res->attempts = sim_stats.attempts;
+	res->ns = sim_now_ns;
+	res->flash_erases = sim_stats.flash_erases;
+	res->spi_transactions = sim_stats.spi_transactions;
+	res->spi_polls = sim_stats.spi_polls;
+	res->spi_buffer_bytes = sim_stats.spi_buffer_bytes;
+	res->mmc_initializes = sim_stats.mmc_initializes;
+	res->lost_successes = sim_stats.lost_successes;
+	for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++)
+		res->phase_us[phase] = g_profile.totals[phase].total_us;
+}
+
+// Mirrors the training loop of firmware_main(), or runs a fixed number of successes
+static void sim_cold_session(sim_unit_result_t *res)
+{
+	glitch_train_t train;
+	glitch_train_init(&train);
+	bool trained;
+	enum STATUSCODE status;
+	do
+	{
+		session_info_t local_si = {0};
+		status = glitch(&null_logger, &local_si, true);
+		res->payload_program_us += local_si.payload_program_us;
+		if (status == OK_GLITCH_SUCCESS && !res->first.ok)
+			sim_result_fill(&res->first, 1);
+		trained = glitch_train_add(&train, status, &local_si);
+		if (g_opt.trains)
+			trained = train.successes >= g_opt.trains;
+	} while (!trained && status != ERR_UNKNOWN_DEVICE && status != ERR_MMC_STATE_UNEXPECTED_NOT_IDENT &&
+		sim_stats.attempts < g_opt.max_train_attempts);
+
+	sim_result_fill(&res->training, trained);
+	res->training_successes = train.successes;
+
+	// The last update is committed by the next boot in firmware_main()
+	config_commit();
+}
+
+static void sim_warm_session(sim_result_t *res)
+{
+	session_info_t si = {0};
+	enum STATUSCODE status = glitch(&null_logger, &si, false);
+	sim_result_fill(res, status == OK_GLITCH_SUCCESS);
+
+	// sdio_handler() commits while the console is idle
+	config_commit();
+}
+
+static void sim_run_forked(void (*session)(void *), void *arg)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		session(arg);
+		_exit(0);
+	}
+
+	int wstatus;
+	waitpid(pid, &wstatus, 0);
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+	{
+		fprintf(stderr, "sim: session crashed\n");
+		exit(1);
+	}
+}
+
+static unsigned int g_unit, g_boot;
+
+static void sim_cold_entry(void *arg)
+{
+	sim_power_on(g_unit, 0);
+	sim_cold_session(arg);
+}
+
+static void sim_warm_entry(void *arg)
+{
+	sim_power_on(g_unit, 1 + g_boot);
+	sim_warm_session(arg);
+}
+
+static void sim_draw_console(unsigned int unit)
+{
+	sim_rand_seed(g_opt.seed ^ (0xC0FFEEull * (unit + 1)));
+	sim_console = g_opt.console;
+	sim_console.device_type = g_opt.device_type;
+
+	// Sweet spot anywhere across the offset window the firmware searches.
+	double lo = g_opt.device_type == DEVICE_TYPE_ERISTA ? 825 : 800;
+	sim_console.offset0 = lo + sim_rand_double() * 80;
+	sim_console.width0 = g_opt.width_min + sim_rand_double() * (g_opt.width_max - g_opt.width_min);
+	sim_console.mmc_short_reset_fails = sim_rand_double() < g_opt.console.mmc_stuck;
+}
+
+static int sim_compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void sim_report(const char *name, double *values, unsigned int count)
+{
+	if (!count)
+	{
+		printf("%-22s %10s\n", name, "-");
+		return;
+	}
+
+	qsort(values, count, sizeof(double), sim_compare_double);
+	double sum = 0;
+	for (unsigned int i = 0; i < count; i++)
+		sum += values[i];
+
+	printf("%-22s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+		values[count / 2], values[(count * 95) / 100], values[(count * 99) / 100],
+		sum / count, values[count - 1]);
+}
+
+static void sim_usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("  -u, --units N           simulated units (%u)\n", g_opt.units);
+	printf("  -b, --boots N           warm boots per unit after training (%u)\n", g_opt.boots);
+	printf("  -s, --seed N            base seed (%llu)\n", (unsigned long long)g_opt.seed);
+	printf("  -d, --device NAME       erista, mariko or lite (mariko)\n");
+	printf("  -t, --trains N          fixed number of training successes, 0 to train as firmware_main (%u)\n", g_opt.trains);
+	printf("      --peak P            success probability at the sweet spot (%.2f)\n", g_opt.console.peak);
+	printf("      --sigma-offset X    sweet spot spread along offset (%.1f)\n", g_opt.console.sigma_offset);
+	printf("      --sigma-width X     sweet spot spread along width (%.1f)\n", g_opt.console.sigma_width);
+	printf("      --hang-scale X      width scale of hang vs. no-effect misses (%.1f)\n", g_opt.console.hang_scale);
+	printf("      --no-comms P        probability of a silent bus after a miss (%.3f)\n", g_opt.console.no_comms);
+	printf("      --depth-signal P    fraction of block-read misses that read more near the sweet spot (%.2f)\n", g_opt.console.depth_signal);
+	printf("      --mmc-stuck P       fraction of units whose eMMC needs the clock-stuck reset (%.2f)\n", g_opt.console.mmc_stuck);
+	printf("      --width-range A:B   range the sweet spot width is drawn from (%.0f:%.0f)\n", g_opt.width_min, g_opt.width_max);
+	printf("  -v, --verbose           print every unit\n");
+	printf("  -x, --decode HEX        decode a capture hex dump from the debug log and exit\n");
+	printf("      --mmc-check         program BOOT0 of the eMMC model through payload.c, check it and exit\n");
+	printf("      --sniff-check       decode the built-in eMMC captures, check the result and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] =
+	{
+		{"units", required_argument, 0, 'u'},
+		{"boots", required_argument, 0, 'b'},
+		{"seed", required_argument, 0, 's'},
+		{"device", required_argument, 0, 'd'},
+		{"trains", required_argument, 0, 't'},
+		{"peak", required_argument, 0, 1},
+		{"sigma-offset", required_argument, 0, 2},
+		{"sigma-width", required_argument, 0, 3},
+		{"hang-scale", required_argument, 0, 4},
+		{"no-comms", required_argument, 0, 5},
+		{"width-range", required_argument, 0, 6},
+		{"depth-signal", required_argument, 0, 7},
+		{"verbose", no_argument, 0, 'v'},
+		{"decode", required_argument, 0, 'x'},
+		{"mmc-check", no_argument, 0, 8},
+		{"mmc-stuck", required_argument, 0, 9},
+		{"sniff-check", no_argument, 0, 10},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "u:b:s:d:t:vx:h", options, 0)) != -1)
+	{
+		switch (c)
+		{
+			case 'u': g_opt.units = strtoul(optarg, 0, 0); break;
+			case 'b': g_opt.boots = strtoul(optarg, 0, 0); break;
+			case 's': g_opt.seed = strtoull(optarg, 0, 0); break;
+			case 't': g_opt.trains = strtoul(optarg, 0, 0); break;
+			case 'd':
+				if (!strcmp(optarg, "erista"))
+					g_opt.device_type = DEVICE_TYPE_ERISTA;
+				else if (!strcmp(optarg, "mariko"))
+					g_opt.device_type = DEVICE_TYPE_MARIKO;
+				else if (!strcmp(optarg, "lite"))
+					g_opt.device_type = DEVICE_TYPE_LITE;
+				else
+				{
+					sim_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 1: g_opt.console.peak = atof(optarg); break;
+			case 2: g_opt.console.sigma_offset = atof(optarg); break;
+			case 3: g_opt.console.sigma_width = atof(optarg); break;
+			case 4: g_opt.console.hang_scale = atof(optarg); break;
+			case 5: g_opt.console.no_comms = atof(optarg); break;
+			case 6:
+				if (sscanf(optarg, "%lf:%lf", &g_opt.width_min, &g_opt.width_max) != 2)
+				{
+					sim_usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 7: g_opt.console.depth_signal = atof(optarg); break;
+			case 8: g_opt.mmc_check = 1; break;
+			case 9: g_opt.console.mmc_stuck = atof(optarg); break;
+			case 10: return sim_sniff_check();
+			case 'v': g_opt.verbose = 1; break;
+			case 'x': return sim_sniff_print(optarg);
+			default:
+				sim_usage(argv[0]);
+				return c != 'h';
+		}
+	}
+
+	if (g_opt.mmc_check)
+		return sim_mmc_check(g_opt.device_type);
+
+	if (!g_opt.units)
+	{
+		sim_usage(argv[0]);
+		return 1;
+	}
+
+	sim_flash_init();
+	sim_mmc_init();
+
+	sim_unit_result_t *units = mmap(0, sizeof(sim_unit_result_t) * g_opt.units, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	sim_result_t *boots = mmap(0, sizeof(sim_result_t) * (g_opt.units * g_opt.boots + 1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (units == MAP_FAILED || boots == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	for (g_unit = 0; g_unit < g_opt.units; g_unit++)
+	{
+		sim_draw_console(g_unit);
+		sim_flash_erase_all();
+		sim_mmc_erase_all(g_opt.seed ^ (0xB007ull * (g_unit + 1)));
+		sim_run_forked(sim_cold_entry, &units[g_unit]);
+
+		for (g_boot = 0; units[g_unit].training.ok && g_boot < g_opt.boots; g_boot++)
+			sim_run_forked(sim_warm_entry, &boots[g_unit * g_opt.boots + g_boot]);
+
+		if (g_opt.verbose)
+		{
+			printf("unit %4u: sweet spot [%.1f, %.1f] first %u attempts / %.2fs, training %u attempts / %.1fs%s\n",
+				g_unit, sim_console.offset0, sim_console.width0,
+				units[g_unit].first.attempts, units[g_unit].first.ns / 1e9,
+				units[g_unit].training.attempts, units[g_unit].training.ns / 1e9,
+				units[g_unit].training.ok ? "" : " FAILED");
+		}
+	}
+
+	double *values = malloc(sizeof(double) * (g_opt.units * g_opt.boots + g_opt.units));
+	unsigned int n, failed_training = 0, failed_boots = 0;
+
+	char trains[32] = "confidence";
+	if (g_opt.trains)
+		snprintf(trains, sizeof(trains), "%u", g_opt.trains);
+	printf("%u units (%s), %u warm boots each, %s training successes, seed %llu\n", g_opt.units,
+		g_opt.device_type == DEVICE_TYPE_ERISTA ? "erista" : g_opt.device_type == DEVICE_TYPE_MARIKO ? "mariko" : "lite",
+		g_opt.boots, trains, (unsigned long long)g_opt.seed);
+	printf("%-22s %10s %10s %10s %10s %10s\n", "", "p50", "p95", "p99", "mean", "max");
+
+#define REPORT(name, expr, cond) \
+	do { n = 0; for (unsigned int i = 0; i < g_opt.units; i++) if (cond) values[n++] = (expr); sim_report(name, values, n); } while (0)
+
+	REPORT("cold attempts", units[i].first.attempts, units[i].first.ok);
+	REPORT("cold time [s]", units[i].first.ns / 1e9, units[i].first.ok);
+	REPORT("training successes", units[i].training_successes, units[i].training.ok);
+	REPORT("training attempts", units[i].training.attempts, units[i].training.ok);
+	REPORT("training time [s]", units[i].training.ns / 1e9, units[i].training.ok);
+	REPORT("training erases", units[i].training.flash_erases, units[i].training.ok);
+	REPORT("payload flash [ms]", units[i].payload_program_us / 1e3, units[i].training.ok);
+
+	for (unsigned int i = 0; i < g_opt.units; i++)
+		failed_training += !units[i].training.ok;
+
+	n = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+	{
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+		{
+			if (boots[i * g_opt.boots + j].ok)
+				values[n++] = boots[i * g_opt.boots + j].attempts;
+			else
+				failed_boots++;
+		}
+	}
+	sim_report("warm attempts", values, n);
+
+	n = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+			if (boots[i * g_opt.boots + j].ok)
+				values[n++] = boots[i * g_opt.boots + j].ns / 1e6;
+	sim_report("warm time [ms]", values, n);
+
+	// Where the warm boot time goes, by boot timeline phase
+	for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++)
+	{
+		char name[32];
+		double seen = 0;
+		n = 0;
+		for (unsigned int i = 0; i < g_opt.units; i++)
+		{
+			for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+			{
+				if (boots[i * g_opt.boots + j].ok)
+				{
+					values[n++] = boots[i * g_opt.boots + j].phase_us[phase] / 1e3;
+					seen += values[n - 1];
+				}
+			}
+		}
+		snprintf(name, sizeof(name), " %s [ms]", profile_phase_name(phase));
+		if (seen)
+			sim_report(name, values, n);
+	}
+
+	n = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+			if (boots[i * g_opt.boots + j].ok)
+				values[n++] = (double)boots[i * g_opt.boots + j].spi_polls / boots[i * g_opt.boots + j].attempts;
+	sim_report("warm SPI polls/attempt", values, n);
+
+	n = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+			if (boots[i * g_opt.boots + j].ok)
+				values[n++] = (double)(boots[i * g_opt.boots + j].spi_transactions - boots[i * g_opt.boots + j].spi_polls) / boots[i * g_opt.boots + j].attempts;
+	sim_report("warm SPI other/attempt", values, n);
+
+	n = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+			if (boots[i * g_opt.boots + j].ok)
+				values[n++] = (double)boots[i * g_opt.boots + j].spi_buffer_bytes / boots[i * g_opt.boots + j].attempts;
+	sim_report("warm SPI bytes/attempt", values, n);
+
+	unsigned int lost_successes = 0, training_mmc_inits = 0, warm_mmc_inits = 0;
+	for (unsigned int i = 0; i < g_opt.units; i++)
+	{
+		lost_successes += units[i].training.lost_successes;
+		training_mmc_inits += units[i].training.mmc_initializes;
+		for (unsigned int j = 0; units[i].training.ok && j < g_opt.boots; j++)
+		{
+			lost_successes += boots[i * g_opt.boots + j].lost_successes;
+			warm_mmc_inits += boots[i * g_opt.boots + j].mmc_initializes;
+		}
+	}
+
+	printf("failed trainings: %u, failed warm boots: %u\n", failed_training, failed_boots);
+	printf("successes lost to a short timeout: %u\n", lost_successes);
+	printf("eMMC initializations: %u in trainings, %u in warm boots\n", training_mmc_inits, warm_mmc_inits);
+
+	free(values);
+	return 0;
+}
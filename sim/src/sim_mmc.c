@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Model of the eMMC behind the FPGA's command engine. Runs the descriptors mmc.c
+// writes to FPGA_BUFFER_CMD against a card state machine and the BOOT0 partition,
+// and tells how long the bus is busy with each. Anything a real card would reject
+// or silently misinterpret ends the simulation, so protocol slips in mmc.c show up
+// as a crash rather than as odd numbers.
+
+#include <sim.h>
+#include <mmc.h>
+#include <payload.h>
+#include <statuscode.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mmc_defs.h"
+#include "sd.h"
+
+// Descriptor byte of a command frame, as in mmc.c
+#define SIM_MMC_DESC_COMMAND 0x01
+#define SIM_MMC_DESC_READ 0x02
+#define SIM_MMC_DESC_WRITE 0x04
+#define SIM_MMC_DESC_LONG 0x08
+
+#define SIM_MMC_BOOT0_SECTORS 0x2000 // 4 MiB
+#define SIM_MMC_RCA 2
+#define SIM_MMC_READY_US 1000 // GO_IDLE until SEND_OP_COND reports the card ready
+
+// Bus timing of the FPGA's command engine: 1-bit data at a 12 MHz clock, model figures
+#define SIM_MMC_CLOCK_NS 84
+#define SIM_MMC_COMMAND_CLOCKS (48 + 8 + 48) // command, Ncr and a 48-bit response
+#define SIM_MMC_LONG_CLOCKS (48 + 8 + 136)
+#define SIM_MMC_BLOCK_CLOCKS (1 + 512 * 8 + 16 + 1) // start bit, data, CRC16, end bit
+#define SIM_MMC_READ_ACCESS_US 60 // until the first block of a read starts
+#define SIM_MMC_PROGRAM_US 250 // busy after every block written
+#define SIM_MMC_TRIM_US 1500 // busy after ERASE with the TRIM argument, for a range within one erase group
+#define SIM_MMC_TRIM_MULT 2 // EXT_CSD TRIM_MULT, 600ms
+
+static const uint8_t g_cid[15] = {0x15, 0x01, 0x00, 'B', 'J', 'T', 'D', '4', 'R', 0x00, 0x12, 0x34, 0x56, 0x78, 0x9A};
+static const uint8_t g_csd[15] = {0xD0, 0x27, 0x01, 0x32, 0x0F, 0x59, 0x03, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x92, 0x40, 0x00};
+
+static uint8_t *g_boot0;
+static int g_trim = 1; // EXT_CSD reports TRIM
+
+static struct
+{
+	uint8_t state; // R1_STATE_*
+	uint8_t partition; // EXT_CSD_PART_CONFIG access bits
+	uint8_t silent; // the console's boot ROM holds the bus, see sim_console_t.mmc_short_reset_fails
+	uint64_t idle_ns; // of the last GO_IDLE
+	uint32_t erase_start, erase_end; // erase sequence, sector + 1 once set
+	uint64_t busy_ns; // in PRG until then
+} g_card;
+
+static void sim_mmc_fail(const char *what, uint32_t value)
+{
+	fprintf(stderr, "sim: eMMC model: %s (0x%X)\n", what, value);
+	exit(1);
+}
+
+void sim_mmc_init()
+{
+	g_boot0 = mmap(0, SIM_MMC_BOOT0_SECTORS * MMC_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (g_boot0 == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+}
+
+// BOOT0 of a unit that has never seen the modchip: content that matches nothing flash_payload() writes
+void sim_mmc_erase_all(uint64_t seed)
+{
+	uint64_t x = seed | 1;
+	for (uint32_t i = 0; i < SIM_MMC_BOOT0_SECTORS * MMC_BLOCK_SIZE; i += 8)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(&g_boot0[i], &x, 8);
+	}
+}
+
+uint8_t *sim_mmc_sector(uint32_t sector)
+{
+	if (sector >= SIM_MMC_BOOT0_SECTORS)
+		sim_mmc_fail("sector outside BOOT0", sector);
+	return &g_boot0[sector * MMC_BLOCK_SIZE];
+}
+
+void sim_mmc_set_trim(int supported)
+{
+	g_trim = supported;
+}
+
+static void sim_mmc_go_idle()
+{
+	uint8_t silent = g_card.silent;
+	memset(&g_card, 0, sizeof(g_card));
+	g_card.state = R1_STATE_IDLE;
+	g_card.silent = silent;
+	g_card.idle_ns = sim_now_ns;
+}
+
+void sim_mmc_power_cycle(int clock_stuck)
+{
+	g_card.silent = !clock_stuck && sim_console.mmc_short_reset_fails;
+	sim_mmc_go_idle();
+}
+
+static uint8_t sim_mmc_crc7(const uint8_t *buffer, int size)
+{
+	uint8_t crc = 0;
+	for (int i = 0; i < size; i++)
+	{
+		uint8_t c = buffer[i];
+		for (int j = 0; j < 8; j++)
+		{
+			crc <<= 1;
+			if ((crc ^ c) & 0x80)
+				crc ^= 9;
+			c <<= 1;
+		}
+		crc &= 0x7F;
+	}
+	return crc;
+}
+
+static void sim_mmc_response(uint8_t *response, uint8_t index, uint32_t value)
+{
+	response[0] = index;
+	response[1] = value >> 24;
+	response[2] = value >> 16;
+	response[3] = value >> 8;
+	response[4] = value;
+	response[5] = (sim_mmc_crc7(response, 5) << 1) | 1;
+}
+
+static void sim_mmc_long_response(uint8_t *response, const uint8_t *reg)
+{
+	response[0] = 0x3F;
+	memcpy(&response[1], reg, 15);
+	response[16] = (sim_mmc_crc7(reg, 15) << 1) | 1;
+}
+
+static void sim_mmc_require(uint8_t state, uint8_t cmd)
+{
+	if (g_card.state != state)
+		sim_mmc_fail("command in the wrong state", (cmd << 8) | g_card.state);
+}
+
+// Data phase of one block of the partition mmc_initialize() switched to
+static uint64_t sim_mmc_block(uint8_t desc, uint32_t sector, uint8_t *data)
+{
+	if (g_card.partition != EXT_CSD_PART_CONFIG_ACC_BOOT0)
+		sim_mmc_fail("data access outside BOOT0", g_card.partition);
+
+	uint64_t ns = (uint64_t)SIM_MMC_BLOCK_CLOCKS * SIM_MMC_CLOCK_NS;
+	if (desc == SIM_MMC_DESC_READ)
+	{
+		memcpy(data, sim_mmc_sector(sector), MMC_BLOCK_SIZE);
+		sim_stats.mmc_blocks_read++;
+	}
+	else
+	{
+		memcpy(sim_mmc_sector(sector), data, MMC_BLOCK_SIZE);
+		sim_stats.mmc_blocks_written++;
+		ns += SIM_US(SIM_MMC_PROGRAM_US);
+	}
+	return ns;
+}
+
+// Single block read or write
+static uint64_t sim_mmc_transfer(uint8_t cmd, uint8_t desc, uint32_t sector, uint8_t *data)
+{
+	sim_mmc_require(R1_STATE_TRAN, cmd);
+
+	uint64_t ns = sim_mmc_block(desc, sector, data);
+	if (desc == SIM_MMC_DESC_READ)
+		ns += SIM_US(SIM_MMC_READ_ACCESS_US);
+	return ns;
+}
+
+uint64_t sim_mmc_execute(const uint8_t *frame, uint8_t *response, uint8_t *data)
+{
+	uint8_t cmd = frame[0] & 0x3F;
+	uint8_t desc = frame[6];
+	uint32_t arg = ((uint32_t)frame[1] << 24) | ((uint32_t)frame[2] << 16) | ((uint32_t)frame[3] << 8) | frame[4];
+
+	if ((frame[0] & 0xC0) != 0x40 || frame[5] != ((sim_mmc_crc7(frame, 5) << 1) | 1))
+		sim_mmc_fail("malformed command frame", frame[0]);
+	if (g_card.state == R1_STATE_PRG && sim_now_ns >= g_card.busy_ns)
+		g_card.state = R1_STATE_TRAN;
+	if (g_card.state == R1_STATE_PRG && cmd != MMC_SEND_STATUS)
+		sim_mmc_fail("command while the card is busy", cmd);
+
+	uint8_t data_desc = 0;
+	if (cmd == MMC_READ_SINGLE_BLOCK || cmd == MMC_SEND_EXT_CSD)
+		data_desc = SIM_MMC_DESC_READ;
+	else if (cmd == MMC_WRITE_BLOCK)
+		data_desc = SIM_MMC_DESC_WRITE;
+	uint8_t long_desc = (cmd == MMC_ALL_SEND_CID || cmd == MMC_SEND_CSD) ? SIM_MMC_DESC_LONG : 0;
+	if (desc != (SIM_MMC_DESC_COMMAND | data_desc | long_desc))
+		sim_mmc_fail("descriptor does not fit the command", (cmd << 8) | desc);
+
+	sim_stats.mmc_commands++;
+	if (g_card.silent && cmd != MMC_GO_IDLE_STATE)
+		return SIM_MMC_NO_RESPONSE;
+	uint64_t ns = (uint64_t)(long_desc ? SIM_MMC_LONG_CLOCKS : SIM_MMC_COMMAND_CLOCKS) * SIM_MMC_CLOCK_NS;
+
+	// R1 carries the state the command was received in
+	uint32_t status = ((uint32_t)g_card.state << 9) | R1_READY_FOR_DATA;
+	switch (cmd)
+	{
+		case MMC_GO_IDLE_STATE:
+			sim_mmc_go_idle();
+			sim_stats.mmc_initializes++;
+			memset(response, 0, 6);
+			break;
+
+		case MMC_SEND_OP_COND:
+		{
+			if (g_card.state != R1_STATE_IDLE && g_card.state != R1_STATE_READY)
+				sim_mmc_require(R1_STATE_IDLE, cmd);
+			uint32_t ocr = 0x00FF8080;
+			if (sim_now_ns >= g_card.idle_ns + SIM_US(SIM_MMC_READY_US))
+			{
+				ocr |= MMC_CARD_BUSY | SD_OCR_CCS;
+				g_card.state = R1_STATE_READY;
+			}
+			sim_mmc_response(response, 0x3F, ocr);
+			response[5] = 0xFF;
+			break;
+		}
+
+		case MMC_ALL_SEND_CID:
+			sim_mmc_require(R1_STATE_READY, cmd);
+			sim_mmc_long_response(response, g_cid);
+			g_card.state = R1_STATE_IDENT;
+			break;
+
+		case MMC_SET_RELATIVE_ADDR:
+			sim_mmc_require(R1_STATE_IDENT, cmd);
+			if (arg >> 16 != SIM_MMC_RCA)
+				sim_mmc_fail("relative address", arg);
+			sim_mmc_response(response, cmd, status);
+			g_card.state = R1_STATE_STBY;
+			break;
+
+		case MMC_SEND_CSD:
+			sim_mmc_require(R1_STATE_STBY, cmd);
+			sim_mmc_long_response(response, g_csd);
+			break;
+
+		case MMC_SELECT_CARD:
+			sim_mmc_require(R1_STATE_STBY, cmd);
+			sim_mmc_response(response, cmd, status);
+			g_card.state = R1_STATE_TRAN;
+			break;
+
+		case MMC_SEND_STATUS:
+			sim_mmc_response(response, cmd, status);
+			break;
+
+		case MMC_SET_BLOCKLEN:
+			sim_mmc_require(R1_STATE_TRAN, cmd);
+			if (arg != MMC_BLOCK_SIZE)
+				sim_mmc_fail("block length", arg);
+			sim_mmc_response(response, cmd, status);
+			break;
+
+		case MMC_SWITCH:
+			sim_mmc_require(R1_STATE_TRAN, cmd);
+			if (((arg >> 16) & 0xFF) != EXT_CSD_PART_CONFIG)
+				sim_mmc_fail("EXT_CSD byte not modelled", arg);
+			g_card.partition = (arg >> 8) & EXT_CSD_PART_CONFIG_ACC_MASK;
+			sim_mmc_response(response, cmd, status);
+			break;
+
+		case MMC_SEND_EXT_CSD:
+			sim_mmc_require(R1_STATE_TRAN, cmd);
+			memset(data, 0, MMC_BLOCK_SIZE);
+			data[EXT_CSD_REV] = 8;
+			data[EXT_CSD_ERASED_MEM_CONT] = 0;
+			data[EXT_CSD_SEC_FEATURE_SUPPORT] = g_trim ? EXT_CSD_SEC_GB_CL_EN : 0;
+			data[EXT_CSD_TRIM_MULT] = g_trim ? SIM_MMC_TRIM_MULT : 0;
+			sim_mmc_response(response, cmd, status);
+			ns += SIM_US(SIM_MMC_READ_ACCESS_US) + (uint64_t)SIM_MMC_BLOCK_CLOCKS * SIM_MMC_CLOCK_NS;
+			break;
+
+		case MMC_ERASE_GROUP_START:
+		case MMC_ERASE_GROUP_END:
+			sim_mmc_require(R1_STATE_TRAN, cmd);
+			if (arg >= SIM_MMC_BOOT0_SECTORS)
+				sim_mmc_fail("erase past the end of BOOT0", arg);
+			if (cmd == MMC_ERASE_GROUP_START)
+				g_card.erase_start = arg + 1;
+			else if (!g_card.erase_start || arg + 1 < g_card.erase_start)
+				sim_mmc_fail("erase end without a start before it", arg);
+			else
+				g_card.erase_end = arg + 1;
+			sim_mmc_response(response, cmd, status);
+			break;
+
+		case MMC_ERASE:
+			sim_mmc_require(R1_STATE_TRAN, cmd);
+			if (!g_card.erase_end)
+				sim_mmc_fail("erase without its range", arg);
+			if (arg != MMC_TRIM_ARG || !g_trim)
+				sim_mmc_fail("erase other than a supported TRIM", arg);
+			if (g_card.partition != EXT_CSD_PART_CONFIG_ACC_BOOT0)
+				sim_mmc_fail("erase outside BOOT0", g_card.partition);
+			memset(sim_mmc_sector(g_card.erase_start - 1), 0, (g_card.erase_end - g_card.erase_start + 1) * MMC_BLOCK_SIZE);
+			sim_stats.mmc_blocks_trimmed += g_card.erase_end - g_card.erase_start + 1;
+			sim_mmc_response(response, cmd, status);
+			// R1b: the FPGA is done with the response, the card stays busy in PRG
+			g_card.state = R1_STATE_PRG;
+			g_card.busy_ns = sim_now_ns + ns + SIM_US(SIM_MMC_TRIM_US);
+			break;
+
+		case MMC_READ_SINGLE_BLOCK:
+		case MMC_WRITE_BLOCK:
+			sim_mmc_response(response, cmd, status);
+			ns += sim_mmc_transfer(cmd, data_desc, arg, data);
+			break;
+
+		default:
+			sim_mmc_fail("command not modelled", cmd);
+	}
+
+	// An erase range only holds up to ERASE
+	if (cmd != MMC_ERASE_GROUP_START && cmd != MMC_ERASE_GROUP_END && cmd != MMC_SEND_STATUS)
+		g_card.erase_start = g_card.erase_end = 0;
+	return ns;
+}
+
+typedef struct
+{
+	uint32_t commands;
+	uint32_t blocks_read;
+	uint32_t blocks_written;
+	uint32_t blocks_trimmed;
+	uint32_t spi_bytes;
+	uint64_t ns;
+} sim_mmc_usage_t;
+
+static sim_mmc_usage_t sim_mmc_usage()
+{
+	sim_mmc_usage_t usage = {sim_stats.mmc_commands, sim_stats.mmc_blocks_read, sim_stats.mmc_blocks_written,
+		sim_stats.mmc_blocks_trimmed, sim_stats.spi_buffer_bytes, sim_now_ns};
+	return usage;
+}
+
+static int g_check_failed;
+
+static void sim_mmc_check_step(const char *name, const sim_mmc_usage_t *start, int ok)
+{
+	sim_mmc_usage_t end = sim_mmc_usage();
+	printf("%-28s %6u %6u %6u %6u %10u %10.1f%s\n", name, end.commands - start->commands,
+		end.blocks_read - start->blocks_read, end.blocks_written - start->blocks_written,
+		end.blocks_trimmed - start->blocks_trimmed, end.spi_bytes - start->spi_bytes, (end.ns - start->ns) / 1e6, ok ? "" : "  FAILED");
+	g_check_failed |= !ok;
+}
+
+static int sim_mmc_sectors_equal(uint32_t a, uint32_t b, uint32_t count)
+{
+	return !memcmp(sim_mmc_sector(a), sim_mmc_sector(b), count * MMC_BLOCK_SIZE);
+}
+
+static int sim_mmc_sectors_zero(uint32_t sector, uint32_t count)
+{
+	for (uint32_t i = 0; i < count * MMC_BLOCK_SIZE; i++)
+		if (sim_mmc_sector(sector)[i])
+			return 0;
+	return 1;
+}
+
+// Runs the BOOT0 programming of payload.c and the block transfers of mmc.c against the
+// model, checks what ends up on the card and what it took
+int sim_mmc_check(enum DEVICE_TYPE device_type)
+{
+	uint8_t cid[16];
+	sim_mmc_usage_t start;
+	enum STATUSCODE status;
+
+	sim_mmc_init();
+	sim_mmc_erase_all(1);
+	sim_mmc_power_cycle(0);
+
+	printf("eMMC model check (%s)\n", device_type == DEVICE_TYPE_ERISTA ? "erista" : "mariko");
+	printf("%-28s %6s %6s %6s %6s %10s %10s\n", "", "cmds", "reads", "writes", "trims", "SPI bytes", "time [ms]");
+
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, true);
+	sim_mmc_check_step("flash, fresh BOOT0", &start, status == OK_FLASH_SUCCESS && sim_stats.mmc_blocks_written > start.blocks_written);
+	uint8_t stamp[MMC_BLOCK_SIZE];
+	memcpy(stamp, sim_mmc_sector(PAYLOAD_STAMP_SECTOR), sizeof(stamp));
+
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, true);
+	sim_mmc_check_step("flash, stamp trusted", &start, status == OK_FLASH_SUCCESS &&
+		sim_stats.mmc_blocks_written == start.blocks_written && sim_stats.mmc_blocks_read - start.blocks_read == 2);
+
+	// Every block read back matches: the first flash wrote the right data to the right sectors
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, false);
+	sim_mmc_check_step("flash, stamp ignored", &start, status == OK_FLASH_SUCCESS &&
+		sim_stats.mmc_blocks_written - start.blocks_written == 1 && !memcmp(stamp, sim_mmc_sector(PAYLOAD_STAMP_SECTOR), sizeof(stamp)));
+
+	start = sim_mmc_usage();
+	status = verify_payload(cid, device_type);
+	sim_mmc_check_step("verify", &start, status == OK_FLASH_SUCCESS && sim_stats.mmc_blocks_written == start.blocks_written);
+
+	// Two runs of damaged payload blocks, each rewritten in one go
+	memset(sim_mmc_sector(0x1F84), 0xA5, 3 * MMC_BLOCK_SIZE);
+	memset(sim_mmc_sector(0x1F90), 0x5A, 8 * MMC_BLOCK_SIZE);
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, false);
+	sim_mmc_check_step("flash, 11 blocks damaged", &start, status == OK_FLASH_SUCCESS &&
+		sim_stats.mmc_blocks_written - start.blocks_written == 11 + 1);
+
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, false);
+	sim_mmc_check_step("flash, repaired", &start, status == OK_FLASH_SUCCESS && sim_stats.mmc_blocks_written - start.blocks_written == 1);
+
+	uint8_t pattern[16 * MMC_BLOCK_SIZE], readback[sizeof(pattern)];
+	for (uint32_t i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i * 7 + (i >> 9);
+	start = sim_mmc_usage();
+	uint32_t ret = mmc_initialize(0);
+	if (!ret)
+		ret = mmc_write_blocks(0x1000, 16, pattern);
+	sim_mmc_check_step("write 16 blocks", &start, !ret && !memcmp(sim_mmc_sector(0x1000), pattern, sizeof(pattern)));
+
+	start = sim_mmc_usage();
+	ret = mmc_read_blocks(0x1000, 16, readback);
+	sim_mmc_check_step("read 16 blocks", &start, !ret && !memcmp(readback, pattern, sizeof(pattern)));
+
+	// erase_payload() with TRIM, then on a card without it after flashing again
+	for (int trim = 1; trim >= 0; trim--)
+	{
+		sim_mmc_set_trim(trim);
+		if (!trim)
+		{
+			start = sim_mmc_usage();
+			status = flash_payload(cid, device_type, true);
+			sim_mmc_check_step("flash, erased BOOT0", &start, status == OK_FLASH_SUCCESS);
+		}
+
+		start = sim_mmc_usage();
+		status = erase_payload();
+		sim_mmc_check_step(trim ? "erase, TRIM" : "erase, writing zeroes", &start, status == OK_FLASH_SUCCESS &&
+			sim_mmc_sectors_equal(0, 0x40, 0x2800 / MMC_BLOCK_SIZE) && sim_mmc_sectors_equal(0x20, 0x60, 0x2800 / MMC_BLOCK_SIZE) &&
+			sim_mmc_sectors_zero(0x1F80, 0x4000 / MMC_BLOCK_SIZE) && sim_mmc_sectors_zero(PAYLOAD_STAMP_SECTOR, 1) &&
+			(sim_stats.mmc_blocks_trimmed - start.blocks_trimmed == (trim ? 0x4000 / MMC_BLOCK_SIZE + 1 : 0)));
+	}
+	sim_mmc_set_trim(1);
+
+	// A console whose boot ROM keeps the bus after the short reset
+	sim_console.mmc_short_reset_fails = 1;
+	start = sim_mmc_usage();
+	status = flash_payload(cid, device_type, true);
+	sim_mmc_check_step("flash, short reset fails", &start, status == OK_FLASH_SUCCESS && g_mmc_bringup.clock_stuck);
+	sim_console.mmc_short_reset_fails = 0;
+
+	printf("eMMC model check %s\n", g_check_failed ? "FAILED" : "passed");
+	return g_check_failed;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2022 HWFLY-NX
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs of the firmware's eMMC capture decoder on hex dumps as dbg_logger_glitch_result()
+// prints them: one given on the command line, or the captures below against what the
+// decoder has to make of them.
+
+#include <sim.h>
+#include <mmc_sniffer.h>
+#include <stdio.h>
+#include <string.h>
+#include "mmc_defs.h"
+
+#define SIM_SNIFF_MAX_LEN 512
+#define SIM_SNIFF_UNKNOWN 0xFF // card state before any frame told it
+
+typedef struct
+{
+	uint8_t type; // MMC_SNIFF_EVENT_TYPE
+	uint8_t cmd;
+	uint8_t flags;
+	uint8_t state;
+} sim_sniff_event_t;
+
+typedef struct
+{
+	const char *name;
+	const char *hex;
+	sim_sniff_event_t events[MMC_SNIFF_MAX_EVENTS];
+	uint8_t count;
+	uint8_t frames;
+	uint8_t bad_frames;
+	uint8_t unpaired;
+	uint8_t seen;
+	uint32_t last_sector;
+} sim_sniff_capture_t;
+
+#define CMD(index, state) {MMC_SNIFF_EVENT_COMMAND, index, 0, state}
+#define RESP(index, state) {MMC_SNIFF_EVENT_RESPONSE, index, 0, state}
+#define UNPAIRED(index, state) {MMC_SNIFF_EVENT_RESPONSE, index, MMC_SNIFF_EVENT_UNPAIRED, state}
+#define BAD(index, state) {MMC_SNIFF_EVENT_BAD_FRAME, index, 0, state}
+
+// Made up from the frames the boot ROM sends, with the CID and CSD of the eMMC model.
+// R2 and R3 carry 0x3F where R1 has the command index; R3 ends in 0xFF instead of a CRC7.
+static const sim_sniff_capture_t g_captures[] =
+{
+	{
+		// GO_IDLE through identification to a BCT and a payload read
+		"boot",
+		"4000000000954140FF8080893FC0FF8080FF42000000004D3F150100424A5444345200123456789AFF43000200009D03"
+		"00000500FB4900020000133FD02701320F5903FFFFFFFFFF9240001547000200003F0700000700755100000000551100"
+		"000900675100001F8077110000090067",
+		{
+			CMD(MMC_GO_IDLE_STATE, R1_STATE_IDLE),
+			CMD(MMC_SEND_OP_COND, R1_STATE_READY), RESP(MMC_SEND_OP_COND, R1_STATE_READY),
+			CMD(MMC_ALL_SEND_CID, R1_STATE_IDENT), RESP(MMC_ALL_SEND_CID, R1_STATE_IDENT),
+			CMD(MMC_SET_RELATIVE_ADDR, R1_STATE_STBY), RESP(MMC_SET_RELATIVE_ADDR, R1_STATE_STBY),
+			CMD(MMC_SEND_CSD, R1_STATE_STBY), RESP(MMC_SEND_CSD, R1_STATE_STBY),
+			CMD(MMC_SELECT_CARD, R1_STATE_TRAN), RESP(MMC_SELECT_CARD, R1_STATE_TRAN),
+			CMD(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN), RESP(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN),
+			CMD(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN), RESP(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN),
+		},
+		15, 15, 0, 0,
+		MMC_SNIFF_SEEN_RESET | MMC_SNIFF_SEEN_IDENT | MMC_SNIFF_SEEN_BLOCK_READ | MMC_SNIFF_SEEN_BCT_READ | MMC_SNIFF_SEEN_PAYLOAD_READ,
+		0x1F80,
+	},
+	{
+		// Starts on the 136-bit CSD answering a SEND_CSD from before the capture
+		"R2 at the start",
+		"3FD02701320F5903FFFFFFFFFF9240001547000200003F07000007007551000000409D110000090067",
+		{
+			RESP(0x3F, SIM_SNIFF_UNKNOWN),
+			CMD(MMC_SELECT_CARD, R1_STATE_TRAN), RESP(MMC_SELECT_CARD, R1_STATE_TRAN),
+			CMD(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN), RESP(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN),
+		},
+		5, 5, 0, 0,
+		MMC_SNIFF_SEEN_BLOCK_READ | MMC_SNIFF_SEEN_BCT_READ,
+		0x40,
+	},
+	{
+		// Starts on the OCR answering the last SEND_OP_COND
+		"R3 at the start",
+		"3FC0FF8080FF42000000004D3F150100424A5444345200123456789AFF43000200009D0300000500FB",
+		{
+			RESP(0x3F, SIM_SNIFF_UNKNOWN),
+			CMD(MMC_ALL_SEND_CID, R1_STATE_IDENT), RESP(MMC_ALL_SEND_CID, R1_STATE_IDENT),
+			CMD(MMC_SET_RELATIVE_ADDR, R1_STATE_STBY), RESP(MMC_SET_RELATIVE_ADDR, R1_STATE_STBY),
+		},
+		5, 5, 0, 0,
+		MMC_SNIFF_SEEN_IDENT,
+		0,
+	},
+	{
+		// Three bytes of noise between two reads, then a response with the wrong index
+		// and one to no command
+		"resync and pairing",
+		"5100001F8077110000090067FFA5C35100001F81651200000900D30D000009003F",
+		{
+			CMD(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN), RESP(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN),
+			BAD(0x3F, R1_STATE_TRAN),
+			CMD(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN), UNPAIRED(MMC_READ_SINGLE_BLOCK, R1_STATE_TRAN),
+			UNPAIRED(MMC_SEND_STATUS, R1_STATE_TRAN),
+		},
+		6, 5, 1, 2,
+		MMC_SNIFF_SEEN_BLOCK_READ | MMC_SNIFF_SEEN_PAYLOAD_READ,
+		0x1F81,
+	},
+};
+
+static int sim_sniff_parse(const char *hex, uint8_t *data, unsigned int *len)
+{
+	*len = 0;
+	while (hex[0] && hex[1] && *len < SIM_SNIFF_MAX_LEN)
+	{
+		unsigned int byte;
+		if (sscanf(hex, "%2x", &byte) != 1)
+		{
+			fprintf(stderr, "sim: not a hex dump at '%s'\n", hex);
+			return 1;
+		}
+		data[(*len)++] = byte;
+		hex += 2;
+	}
+	return 0;
+}
+
+int sim_sniff_print(const char *hex)
+{
+	uint8_t data[SIM_SNIFF_MAX_LEN];
+	unsigned int len;
+	if (sim_sniff_parse(hex, data, &len))
+		return 1;
+
+	static const char *states[] = {"idle", "ready", "ident", "stby", "tran", "data", "rcv", "prg", "dis"};
+	mmc_sniff_t sniff;
+	mmc_sniff_init(&sniff);
+	mmc_sniff_decode(&sniff, data, len);
+	for (unsigned int i = 0; i < sniff.count; i++)
+	{
+		const mmc_sniff_event_t *ev = &sniff.events[i];
+		const char *state = ev->state < sizeof(states) / sizeof(states[0]) ? states[ev->state] : "?";
+		if (ev->type == MMC_SNIFF_EVENT_COMMAND)
+			printf("CMD%-2u   %08X  -> %s\n", ev->cmd, ev->arg, state);
+		else if (ev->type == MMC_SNIFF_EVENT_RESPONSE)
+			printf("  resp  %08X  -> %s%s\n", ev->arg, state, (ev->flags & MMC_SNIFF_EVENT_UNPAIRED) ? " (unpaired)" : "");
+		else
+			printf("bad frame\n");
+	}
+	printf("%u bytes, %u frames, %u bad, %u unpaired; seen:%s%s%s%s%s, last sector %X\n", len, sniff.frames, sniff.bad_frames, sniff.unpaired,
+		(sniff.seen & MMC_SNIFF_SEEN_RESET) ? " reset" : "",
+		(sniff.seen & MMC_SNIFF_SEEN_IDENT) ? " ident" : "",
+		(sniff.seen & MMC_SNIFF_SEEN_BLOCK_READ) ? " block-read" : "",
+		(sniff.seen & MMC_SNIFF_SEEN_BCT_READ) ? " bct" : "",
+		(sniff.seen & MMC_SNIFF_SEEN_PAYLOAD_READ) ? " payload" : "",
+		sniff.last_sector);
+	return 0;
+}
+
+static int sim_sniff_check_capture(const sim_sniff_capture_t *cap)
+{
+	uint8_t data[SIM_SNIFF_MAX_LEN];
+	unsigned int len;
+	if (sim_sniff_parse(cap->hex, data, &len))
+		return 0;
+
+	mmc_sniff_t sniff;
+	mmc_sniff_init(&sniff);
+	mmc_sniff_decode(&sniff, data, len);
+
+	int ok = sniff.count == cap->count && sniff.frames == cap->frames && sniff.bad_frames == cap->bad_frames &&
+		sniff.unpaired == cap->unpaired && sniff.seen == cap->seen && sniff.last_sector == cap->last_sector;
+	for (unsigned int i = 0; ok && i < cap->count; i++)
+	{
+		const mmc_sniff_event_t *ev = &sniff.events[i];
+		const sim_sniff_event_t *want = &cap->events[i];
+		ok = ev->type == want->type && ev->cmd == want->cmd && ev->flags == want->flags && ev->state == want->state;
+	}
+
+	printf("%-24s %4u %6u %6u %4u %8u   %02X%s\n", cap->name, len, sniff.count, sniff.frames, sniff.bad_frames, sniff.unpaired,
+		sniff.seen, ok ? "" : "  FAILED");
+	if (!ok)
+		sim_sniff_print(cap->hex);
+	return ok;
+}
+
+// Decode the captures above and compare events, pairing, resynchronization and SEEN_* flags
+int sim_sniff_check()
+{
+	int failed = 0;
+	printf("%-24s %4s %6s %6s %4s %8s %5s\n", "", "len", "events", "frames", "bad", "unpaired", "seen");
+	for (unsigned int i = 0; i < sizeof(g_captures) / sizeof(g_captures[0]); i++)
+		failed |= !sim_sniff_check_capture(&g_captures[i]);
+
+	printf("eMMC capture decoder check %s\n", failed ? "FAILED" : "passed");
+	return failed;
+}